@@ -834,64 +834,210 @@ pub struct MountInfo {
     pub fs_option: String,
 }
 
-#[allow(clippy::useless_conversion)]
-fn parse_mount_info_line(line: &str) -> Option<MountInfo> {
-    let mut iter = line.split_whitespace();
-    let id = iter.next()?.parse().ok()?;
-    let parent = iter.next()?.parse().ok()?;
-    let (maj, min) = iter.next()?.split_once(':')?;
-    let maj = maj.parse().ok()?;
-    let min = min.parse().ok()?;
-    let device = makedev(maj, min).into();
-    let root = iter.next()?.to_string();
-    let target = iter.next()?.to_string();
-    let vfs_option = iter.next()?.to_string();
-    let mut optional = iter.next()?;
-    let mut shared = 0;
-    let mut master = 0;
-    let mut propagation_from = 0;
-    let mut unbindable = false;
-    while optional != "-" {
-        if let Some(peer) = optional.strip_prefix("master:") {
-            master = peer.parse().ok()?;
-        } else if let Some(peer) = optional.strip_prefix("shared:") {
-            shared = peer.parse().ok()?;
-        } else if let Some(peer) = optional.strip_prefix("propagate_from:") {
-            propagation_from = peer.parse().ok()?;
-        } else if optional == "unbindable" {
-            unbindable = true;
-        }
-        optional = iter.next()?;
-    }
-    let fs_type = iter.next()?.to_string();
-    let source = iter.next()?.to_string();
-    let fs_option = iter.next()?.to_string();
-    Some(MountInfo {
-        id,
-        parent,
-        device,
-        root,
-        target,
-        vfs_option,
-        shared,
-        master,
-        propagation_from,
-        unbindable,
-        fs_type,
-        source,
-        fs_option,
-    })
+// A mountinfo entry borrowing from the buffer of MountInfoTable.
+// Optional fields are kept as raw text and only parsed when accessed.
+pub struct MountInfoRef<'a> {
+    pub id: u32,
+    pub parent: u32,
+    pub device: u64,
+    pub root: &'a str,
+    pub target: &'a str,
+    pub vfs_option: &'a str,
+    optional: &'a str,
+    pub fs_type: &'a str,
+    pub source: &'a str,
+    pub fs_option: &'a str,
+}
+
+impl<'a> MountInfoRef<'a> {
+    #[allow(clippy::useless_conversion)]
+    fn parse(line: &'a str) -> Option<Self> {
+        let mut iter = line.split_ascii_whitespace();
+        let id = iter.next()?.parse().ok()?;
+        let parent = iter.next()?.parse().ok()?;
+        let (maj, min) = iter.next()?.split_once(':')?;
+        let maj = maj.parse().ok()?;
+        let min = min.parse().ok()?;
+        let device = makedev(maj, min).into();
+        let root = iter.next()?;
+        let target = iter.next()?;
+        let vfs_option = iter.next()?;
+
+        // Optional fields are terminated by a single hyphen
+        let offset = |s: &str| s.as_ptr() as usize - line.as_ptr() as usize;
+        let mut field = iter.next()?;
+        let start = offset(field);
+        let mut end = start;
+        while field != "-" {
+            end = offset(field) + field.len();
+            field = iter.next()?;
+        }
+
+        Some(MountInfoRef {
+            id,
+            parent,
+            device,
+            root,
+            target,
+            vfs_option,
+            optional: &line[start..end],
+            fs_type: iter.next()?,
+            source: iter.next()?,
+            fs_option: iter.next()?,
+        })
+    }
+
+    fn optional_field(&self, tag: &str) -> u32 {
+        self.optional
+            .split_ascii_whitespace()
+            .find_map(|f| f.strip_prefix(tag)?.parse().ok())
+            .unwrap_or(0)
+    }
+
+    pub fn shared(&self) -> u32 {
+        self.optional_field("shared:")
+    }
+
+    pub fn master(&self) -> u32 {
+        self.optional_field("master:")
+    }
+
+    pub fn propagation_from(&self) -> u32 {
+        self.optional_field("propagate_from:")
+    }
+
+    pub fn unbindable(&self) -> bool {
+        self.optional
+            .split_ascii_whitespace()
+            .any(|f| f == "unbindable")
+    }
+
+    pub fn to_mount_info(&self) -> MountInfo {
+        MountInfo {
+            id: self.id,
+            parent: self.parent,
+            device: self.device,
+            root: self.root.to_string(),
+            target: self.target.to_string(),
+            vfs_option: self.vfs_option.to_string(),
+            shared: self.shared(),
+            master: self.master(),
+            propagation_from: self.propagation_from(),
+            unbindable: self.unbindable(),
+            fs_type: self.fs_type.to_string(),
+            source: self.source.to_string(),
+            fs_option: self.fs_option.to_string(),
+        }
+    }
+}
+
+// The whole mountinfo of a process read into a single buffer. Entries are
+// parsed lazily while iterating, so filtering callers never allocate per line.
+pub struct MountInfoTable {
+    // Paths are not guaranteed to be valid UTF-8, so each line is decoded on its own
+    buf: Vec<u8>,
+}
+
+impl MountInfoTable {
+    pub fn read(pid: &str) -> MountInfoTable {
+        let mut buf = Vec::new();
+        let mut path = format!("/proc/{pid}/mountinfo");
+        if let Ok(mut file) =
+            Utf8CStr::from_string(&mut path).open(OFlag::O_RDONLY | OFlag::O_CLOEXEC)
+            && file.read_to_end(&mut buf).is_err()
+        {
+            buf.clear();
+        }
+        MountInfoTable { buf }
+    }
+
+    fn lines(&self) -> impl Iterator<Item = &[u8]> {
+        self.buf
+            .split(|b| *b == b'\n')
+            .filter(|line| !line.is_empty())
+    }
+
+    // Lines that are not valid UTF-8 or cannot be parsed are skipped
+    pub fn iter(&self) -> impl Iterator<Item = MountInfoRef<'_>> {
+        self.lines()
+            .filter_map(|line| std::str::from_utf8(line).ok())
+            .filter_map(MountInfoRef::parse)
+    }
 }
 
 pub fn parse_mount_info(pid: &str) -> Vec<MountInfo> {
-    let mut res = vec![];
-    let mut path = format!("/proc/{pid}/mountinfo");
-    if let Ok(file) = Utf8CStr::from_string(&mut path).open(OFlag::O_RDONLY | OFlag::O_CLOEXEC) {
-        BufReader::new(file).for_each_line(|line| {
-            parse_mount_info_line(line)
-                .map(|info| res.push(info))
-                .is_some()
-        });
+    MountInfoTable::read(pid)
+        .iter()
+        .map(|info| info.to_mount_info())
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const SYSTEM: &str = "20 1 253:0 / /system ro,relatime shared:1 - ext4 /dev/block/dm-0 ro";
+    const MODULE: &str =
+        "30 20 0:5 /adb/modules/foo/system/bin /system/bin ro master:2 - tmpfs magisk rw";
+
+    fn table(lines: &[&[u8]]) -> MountInfoTable {
+        let mut buf = Vec::new();
+        for line in lines {
+            buf.extend_from_slice(line);
+            buf.push(b'\n');
+        }
+        MountInfoTable { buf }
+    }
+
+    #[test]
+    fn parse_fields() {
+        let t = table(&[SYSTEM.as_bytes(), MODULE.as_bytes()]);
+        let mounts: Vec<_> = t.iter().collect();
+        assert_eq!(mounts.len(), 2);
+
+        let system = &mounts[0];
+        assert_eq!((system.id, system.parent), (20, 1));
+        assert_eq!(system.device, u64::from(makedev(253, 0)));
+        assert_eq!((system.root, system.target), ("/", "/system"));
+        assert_eq!(system.vfs_option, "ro,relatime");
+        assert_eq!(system.shared(), 1);
+        assert_eq!(system.master(), 0);
+        assert_eq!(
+            (system.fs_type, system.source, system.fs_option),
+            ("ext4", "/dev/block/dm-0", "ro")
+        );
+
+        let module = &mounts[1];
+        assert_eq!(module.root, "/adb/modules/foo/system/bin");
+        assert_eq!(module.master(), 2);
+        assert_eq!(module.source, "magisk");
+    }
+
+    #[test]
+    fn no_optional_fields() {
+        let t = table(&[b"1 0 0:1 / / rw - rootfs rootfs rw"]);
+        let mount = t.iter().next().unwrap();
+        assert_eq!(mount.shared(), 0);
+        assert!(!mount.unbindable());
+        assert_eq!(mount.fs_type, "rootfs");
+    }
+
+    #[test]
+    fn skip_bad_lines() {
+        let t = table(&[
+            SYSTEM.as_bytes(),
+            b"40 20 0:6 / /data/\xff\xfe rw - tmpfs tmpfs rw",
+            b"garbage",
+            b"41 20 0:7 / /mnt rw shared:3",
+            MODULE.as_bytes(),
+        ]);
+        let targets: Vec<_> = t.iter().map(|m| m.target).collect();
+        assert_eq!(targets, ["/system", "/system/bin"]);
+    }
+
+    #[test]
+    fn empty_table() {
+        let t = MountInfoTable { buf: Vec::new() };
+        assert_eq!(t.iter().count(), 0);
     }
-    res
 }
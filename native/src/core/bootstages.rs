@@ -9,6 +9,8 @@ use crate::module::disable_modules;
 use crate::mount::{clean_mounts, setup_preinit_dir};
 use crate::resetprop::get_prop;
 use crate::selinux::restorecon;
+use crate::stats::{Stage, span};
+use crate::timeline::{boot_phase, start_boot_timeline};
 use base::const_format::concatcp;
 use base::{BufReadExt, FsPathBuilder, ResultExt, cstr, error, info};
 use bitflags::bitflags;
@@ -123,9 +125,17 @@ impl MagiskD {
             }
         }
 
+        start_boot_timeline();
+        let _phase = boot_phase("post-fs-data", "total");
+
         self.prune_su_access();
+        self.start_package_watcher();
 
-        if !self.setup_magisk_env() {
+        let env_ready = {
+            let _phase = boot_phase("post-fs-data", "magisk_env");
+            self.setup_magisk_env()
+        };
+        if !env_ready {
             error!("* Magisk environment incomplete, abort");
             return true;
         }
@@ -148,12 +158,19 @@ impl MagiskD {
             return true;
         }
 
-        exec_common_scripts(cstr!("post-fs-data"));
+        {
+            let _span = span(Stage::CommonScripts);
+            let _phase = boot_phase("post-fs-data", "common_scripts");
+            exec_common_scripts(cstr!("post-fs-data"));
+        }
         self.zygisk_enabled.store(
             self.get_db_setting(DbEntryKey::ZygiskConfig) != 0,
             Ordering::Release,
         );
-        initialize_denylist();
+        {
+            let _phase = boot_phase("post-fs-data", "denylist");
+            initialize_denylist();
+        }
         self.handle_modules();
         clean_mounts();
 
@@ -163,9 +180,14 @@ impl MagiskD {
     fn late_start(&self) {
         setup_logfile();
         info!("** late_start service mode running");
+        let _phase = boot_phase("service", "total");
 
-        exec_common_scripts(cstr!("service"));
+        {
+            let _span = span(Stage::CommonScripts);
+            exec_common_scripts(cstr!("service"));
+        }
         if let Some(module_list) = self.module_list.get() {
+            let _span = span(Stage::ModuleScripts);
             exec_module_scripts(cstr!("service"), module_list);
         }
     }
@@ -173,6 +195,7 @@ impl MagiskD {
     fn boot_complete(&self) {
         setup_logfile();
         info!("** boot-complete triggered");
+        let _phase = boot_phase("boot-complete", "total");
 
         // Reset the bootloop counter once we have boot-complete
         self.set_db_setting(DbEntryKey::BootloopCount, 0).log_ok();
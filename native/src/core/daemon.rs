@@ -3,38 +3,46 @@ use crate::consts::{
     MAGISK_FILE_CON, MAGISK_FULL_VER, MAGISK_PROC_CON, MAGISK_VER_CODE, MAGISK_VERSION,
     MAIN_CONFIG, MAIN_SOCKET, ROOTMNT, ROOTOVL,
 };
-use crate::db::Sqlite3;
+use crate::db::{DbSnapshot, Sqlite3};
 use crate::ffi::{
     ModuleInfo, RequestCode, RespondCode, denylist_handler, get_magisk_tmp, scan_deny_apps,
 };
 use crate::logging::{android_logging, magisk_logging, setup_logfile, start_log_daemon};
 use crate::module::remove_modules;
-use crate::package::ManagerInfo;
+use crate::mount::invalidate_unmount_plan;
+use crate::package::{ManagerInfo, PackageIndex, dump_package_stats, package_watcher_active};
 use crate::resetprop::{get_prop, set_prop};
 use crate::selinux::restore_tmpcon;
 use crate::socket::{IpcRead, IpcWrite};
+use crate::stats::{self, dump_request_latency, record_request_latency};
 use crate::su::SuInfo;
 use crate::thread::ThreadPool;
-use crate::zygisk::ZygiskState;
+use crate::zygisk::{
+    DecisionTable, FlagsMap, ZygiskState, dump_companion_stats, dump_specialize_cost,
+};
 use base::const_format::concatcp;
 use base::{
     AtomicArc, BufReadExt, FileAttr, FsPathBuilder, LoggedResult, ReadExt, ResultExt, Utf8CStr,
-    Utf8CStrBuf, WriteExt, cstr, fork_dont_care, info, libc, log_err, set_nice_name,
+    Utf8CStrBuf, WriteExt, cstr, fork_dont_care, info, libc, log_err, set_nice_name, warn,
 };
+use nix::errno::Errno;
 use nix::fcntl::OFlag;
 use nix::mount::MsFlags;
+use nix::sys::epoll::{Epoll, EpollCreateFlags, EpollEvent, EpollFlags, EpollTimeout};
 use nix::sys::signal::SigSet;
 use nix::unistd::{dup2_stderr, dup2_stdin, dup2_stdout, getpid, getuid, setsid};
 use num_traits::AsPrimitive;
+use std::collections::HashMap;
 use std::fmt::Write as _;
-use std::io::{BufReader, Write};
+use std::io;
+use std::io::{BufReader, BufWriter, ErrorKind, Read, Write};
 use std::os::fd::{AsFd, AsRawFd, IntoRawFd, RawFd};
 use std::os::unix::net::{UCred, UnixListener, UnixStream};
 use std::process::{Command, exit};
 use std::sync::OnceLock;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
 use std::sync::nonpoison::Mutex;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 // Global magiskd singleton
 pub static MAGISKD: OnceLock<MagiskD> = OnceLock::new();
@@ -45,6 +53,10 @@ pub const AID_APP_START: i32 = 10000;
 pub const AID_APP_END: i32 = 19999;
 pub const AID_USER_OFFSET: i32 = 100000;
 
+// Clients have to send their request code within this time after connecting
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(3);
+const ACCEPT_ERROR_BACKOFF: Duration = Duration::from_millis(10);
+
 pub const fn to_app_id(uid: i32) -> i32 {
     uid % AID_USER_OFFSET
 }
@@ -56,12 +68,21 @@ pub const fn to_user_id(uid: i32) -> i32 {
 #[derive(Default)]
 pub struct MagiskD {
     pub sql_connection: Mutex<Option<Sqlite3>>,
+    pub sql_reader: Mutex<Option<Sqlite3>>,
+    pub db_snapshot: AtomicArc<DbSnapshot>,
+    pub db_snapshot_lock: Mutex<()>,
     pub manager_info: Mutex<ManagerInfo>,
+    pub package_index: AtomicArc<PackageIndex>,
+    pub package_index_lock: Mutex<()>,
     pub boot_stage_lock: Mutex<BootState>,
     pub module_list: OnceLock<Vec<ModuleInfo>>,
     pub zygisk_enabled: AtomicBool,
     pub zygisk: Mutex<ZygiskState>,
     pub cached_su_info: AtomicArc<SuInfo>,
+    pub decision_table: AtomicArc<DecisionTable>,
+    pub decision_table_lock: Mutex<()>,
+    pub decision_generation: AtomicU32,
+    pub flags_map: FlagsMap,
     pub sdk_int: i32,
     pub is_emulator: bool,
     is_recovery: bool,
@@ -127,8 +148,11 @@ impl MagiskD {
             }
             RequestCode::ZYGOTE_RESTART => {
                 info!("** zygote restarted");
-                self.prune_su_access();
-                scan_deny_apps();
+                invalidate_unmount_plan();
+                if !package_watcher_active() {
+                    self.prune_su_access();
+                    scan_deny_apps();
+                }
                 if self.zygisk_enabled.load(Ordering::Relaxed) {
                     self.zygisk.lock().reset(false);
                 }
@@ -147,10 +171,42 @@ impl MagiskD {
             RequestCode::ZYGISK => {
                 self.zygisk_handler(client);
             }
+            RequestCode::GET_STATS => {
+                self.stats_for_cli(client).ok();
+            }
+            RequestCode::IMPORT_POLICIES => {
+                self.import_su_policies(client).ok();
+            }
+            RequestCode::EXPORT_POLICIES => {
+                self.export_su_policies(client).ok();
+            }
             _ => {}
         }
     }
 
+    fn stats_for_cli(&self, mut client: UnixStream) -> LoggedResult<()> {
+        let trace: bool = client.read_decodable()?;
+        let zygisk: bool = client.read_decodable()?;
+        let mut report = Vec::new();
+        if trace {
+            stats::trace::dump(&mut report);
+        } else if zygisk {
+            dump_specialize_cost(self.module_list.get(), &mut report);
+        } else {
+            ThreadPool::global_stats().dump("pool", &mut report);
+            dump_request_latency(&mut report);
+            dump_package_stats(&mut report);
+            let sockets = self.zygisk.lock().companion_sockets();
+            dump_companion_stats(sockets, &mut report);
+        }
+
+        let mut writer = BufWriter::new(&mut client);
+        for line in &report {
+            writer.write_encodable(line)?;
+        }
+        writer.write_encodable("").log()
+    }
+
     fn reboot(&self) {
         if self.is_recovery {
             Command::new("/system/bin/reboot").arg("recovery").status()
@@ -176,7 +232,44 @@ impl MagiskD {
         true
     }
 
-    fn handle_requests(&'static self, mut client: UnixStream) {
+    fn handle_requests(&'static self, client: UnixStream, code: i32, accepted: Instant) {
+        if !(0..RequestCode::END.repr).contains(&code)
+            || code == RequestCode::_SYNC_BARRIER_.repr
+            || code == RequestCode::_STAGE_BARRIER_.repr
+        {
+            // Unknown request code
+            return;
+        }
+
+        let code = RequestCode { repr: code };
+
+        if code.repr < RequestCode::_SYNC_BARRIER_.repr {
+            // These are cheap, handle them in order on the accept thread so that
+            // they are never dropped when the pool is saturated.
+            self.check_and_handle_request(client, code, accepted);
+            return;
+        }
+
+        // Client verification requires accessing procfs, do it in the thread pool
+        let task = move || self.check_and_handle_request(client, code, accepted);
+        if code == RequestCode::SUPERUSER {
+            // su sessions last as long as the shell, they must not take up the pool
+            ThreadPool::exec_long_task(task);
+        } else if !ThreadPool::exec_task(task) {
+            // Never block the accept loop, dropping the task closes the connection
+            warn!(
+                "daemon: thread pool saturated, dropping request {}",
+                code.repr
+            );
+        }
+    }
+
+    fn check_and_handle_request(
+        &'static self,
+        mut client: UnixStream,
+        code: RequestCode,
+        accepted: Instant,
+    ) {
         let Ok(cred) = client.peer_cred() else {
             // Client died
             return;
@@ -206,18 +299,6 @@ impl MagiskD {
             return;
         }
 
-        let mut code = -1;
-        client.read_pod(&mut code).ok();
-        if !(0..RequestCode::END.repr).contains(&code)
-            || code == RequestCode::_SYNC_BARRIER_.repr
-            || code == RequestCode::_STAGE_BARRIER_.repr
-        {
-            // Unknown request code
-            return;
-        }
-
-        let code = RequestCode { repr: code };
-
         // Permission checks
         match code {
             RequestCode::POST_FS_DATA
@@ -226,6 +307,9 @@ impl MagiskD {
             | RequestCode::ZYGOTE_RESTART
             | RequestCode::SQLITE_CMD
             | RequestCode::DENYLIST
+            | RequestCode::GET_STATS
+            | RequestCode::IMPORT_POLICIES
+            | RequestCode::EXPORT_POLICIES
             | RequestCode::STOP_DAEMON
                 if !is_root =>
             {
@@ -249,16 +333,137 @@ impl MagiskD {
             return;
         }
 
+        // Handlers such as su sessions can run for as long as the client wants,
+        // only measure how long it took to get here.
+        record_request_latency(code, accepted.elapsed());
         if code.repr < RequestCode::_SYNC_BARRIER_.repr {
             self.handle_request_sync(client, code)
         } else if code.repr < RequestCode::_STAGE_BARRIER_.repr {
-            ThreadPool::exec_task(move || {
-                self.handle_request_async(client, code, cred);
-            })
+            self.handle_request_async(client, code, cred)
         } else {
-            ThreadPool::exec_task(move || {
-                self.boot_stage_handler(client, code);
-            })
+            self.boot_stage_handler(client, code)
+        }
+    }
+}
+
+struct PendingClient {
+    stream: UnixStream,
+    accepted: Instant,
+    code: [u8; 4],
+    len: usize,
+}
+
+impl PendingClient {
+    // Returns None if the client still has more to send
+    fn read_code(&mut self) -> Option<io::Result<i32>> {
+        loop {
+            match self.stream.read(&mut self.code[self.len..]) {
+                Ok(0) => return Some(Err(ErrorKind::UnexpectedEof.into())),
+                Ok(n) => {
+                    self.len += n;
+                    if self.len == self.code.len() {
+                        return Some(Ok(i32::from_ne_bytes(self.code)));
+                    }
+                }
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) if e.kind() == ErrorKind::WouldBlock => return None,
+                Err(e) => return Some(Err(e)),
+            }
+        }
+    }
+}
+
+// Accept clients and read their request codes without ever blocking, so that clients
+// that never send anything cannot stall requests queued up behind them.
+fn accept_loop(daemon: &'static MagiskD, sock: UnixListener) -> LoggedResult<()> {
+    const LISTENER_KEY: u64 = u64::MAX;
+
+    let epoll = Epoll::new(EpollCreateFlags::EPOLL_CLOEXEC)?;
+    sock.set_nonblocking(true)?;
+    epoll.add(&sock, EpollEvent::new(EpollFlags::EPOLLIN, LISTENER_KEY))?;
+
+    let mut pending: HashMap<RawFd, PendingClient> = HashMap::new();
+    let mut events = [EpollEvent::empty(); 32];
+
+    loop {
+        // Drop all clients that did not send a request code in time
+        let now = Instant::now();
+        pending.retain(|_, c| now < c.accepted + REQUEST_TIMEOUT);
+        let timeout = pending
+            .values()
+            .map(|c| (c.accepted + REQUEST_TIMEOUT).saturating_duration_since(now))
+            .min()
+            .map_or(EpollTimeout::NONE, |d| {
+                EpollTimeout::try_from(d.as_millis() as u32 + 1).unwrap_or(EpollTimeout::MAX)
+            });
+
+        let n = match epoll.wait(&mut events, timeout) {
+            Ok(n) => n,
+            Err(Errno::EINTR) => continue,
+            Err(e) => {
+                warn!("daemon: epoll_wait failed: {e}");
+                continue;
+            }
+        };
+
+        for event in &events[..n] {
+            if event.data() == LISTENER_KEY {
+                loop {
+                    let stream = match sock.accept() {
+                        Ok((stream, _)) => stream,
+                        Err(e) if e.kind() == ErrorKind::WouldBlock => break,
+                        Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+                        Err(e) if e.raw_os_error() == Some(libc::ECONNABORTED) => continue,
+                        Err(e) => {
+                            // Most likely out of fds or memory, none of which is fatal.
+                            // Back off a little as the listener stays readable.
+                            warn!("daemon: accept failed: {e}");
+                            std::thread::sleep(ACCEPT_ERROR_BACKOFF);
+                            break;
+                        }
+                    };
+                    // Sockets accepted from a non-blocking listener are blocking on Linux.
+                    // Only this client is dropped if it cannot be set up.
+                    let fd = stream.as_raw_fd();
+                    if stream.set_nonblocking(true).log().is_err()
+                        || epoll
+                            .add(&stream, EpollEvent::new(EpollFlags::EPOLLIN, fd as u64))
+                            .log()
+                            .is_err()
+                    {
+                        continue;
+                    }
+                    pending.insert(
+                        fd,
+                        PendingClient {
+                            stream,
+                            accepted: Instant::now(),
+                            code: [0; 4],
+                            len: 0,
+                        },
+                    );
+                }
+                continue;
+            }
+
+            let fd = event.data() as RawFd;
+            let Some(client) = pending.get_mut(&fd) else {
+                continue;
+            };
+            let Some(result) = client.read_code() else {
+                continue;
+            };
+            let Some(client) = pending.remove(&fd) else {
+                continue;
+            };
+            let Ok(code) = result else {
+                // Client died, dropping the stream also removes it from epoll
+                continue;
+            };
+            epoll.delete(&client.stream).log_ok();
+            if client.stream.set_nonblocking(false).log().is_ok() {
+                daemon.handle_requests(client.stream, code, client.accepted);
+            }
         }
     }
 }
@@ -413,14 +618,8 @@ fn daemon_entry() {
     sock_path.set_secontext(cstr!(MAGISK_FILE_CON)).log_ok();
 
     // Loop forever to listen for requests
-    let daemon = MagiskD::get();
-    for client in sock.incoming() {
-        if let Ok(client) = client.log() {
-            daemon.handle_requests(client);
-        } else {
-            exit(1);
-        }
-    }
+    accept_loop(MagiskD::get(), sock).ok();
+    exit(1);
 }
 
 pub fn connect_daemon(code: RequestCode, create: bool) -> LoggedResult<UnixStream> {
@@ -1,19 +1,23 @@
 #![allow(improper_ctypes, improper_ctypes_definitions)]
 use crate::daemon::{MAGISKD, MagiskD};
 use crate::ffi::{
-    DbEntryKey, DbStatement, DbValues, MntNsMode, open_and_init_db, sqlite3, sqlite3_errstr,
+    DbEntryKey, DbStatement, DbValues, MntNsMode, open_and_init_db, open_db_readonly, sqlite3,
+    sqlite3_errstr,
 };
+use crate::logging::DEFAULT_LOG_ARCHIVES;
 use crate::socket::{IpcRead, IpcWrite};
 use DbArg::{Integer, Text};
 use base::{LoggedResult, ResultExt, Utf8CStr};
 use num_derive::FromPrimitive;
 use num_traits::FromPrimitive;
+use std::collections::HashMap;
 use std::ffi::c_void;
 use std::io::{BufReader, BufWriter};
 use std::os::unix::net::UnixStream;
 use std::pin::Pin;
 use std::ptr;
 use std::ptr::NonNull;
+use std::sync::Arc;
 use thiserror::Error;
 
 fn sqlite_err_str(code: i32) -> &'static Utf8CStr {
@@ -100,22 +104,15 @@ impl DbEntryKey {
             DbEntryKey::ZygiskConfig => "zygisk",
             DbEntryKey::BootloopCount => "bootloop",
             DbEntryKey::SuManager => "requester",
+            DbEntryKey::LogArchives => "log_archives",
+            DbEntryKey::ZygiskCost => "zygisk_cost",
             _ => "",
         }
     }
 }
 
-impl SqlTable for DbSettings {
-    fn on_row(&mut self, columns: &[String], values: &DbValues) {
-        let mut key = "";
-        let mut value = 0;
-        for (i, column) in columns.iter().enumerate() {
-            if column == "key" {
-                key = values.get_text(i as i32);
-            } else if column == "value" {
-                value = values.get_int(i as i32);
-            }
-        }
+impl DbSettings {
+    fn set(&mut self, key: &str, value: i32) {
         match key {
             "root_access" => self.root_access = RootAccess::from_i32(value).unwrap_or_default(),
             "multiuser_mode" => {
@@ -130,10 +127,39 @@ impl SqlTable for DbSettings {
     }
 }
 
-#[repr(transparent)]
-pub struct Sqlite3(NonNull<sqlite3>);
+// In-memory copy of the settings and strings tables. Readers load the current
+// snapshot without touching SQLite, writers publish a new one after each change.
+#[derive(Default, Clone)]
+pub struct DbSnapshot {
+    loaded: bool,
+    settings: HashMap<String, i32>,
+    strings: HashMap<String, String>,
+}
+
+// Prepared statements that are kept around, keyed by their SQL text.
+// The least recently used one is finalized when the cache is full.
+const STMT_CACHE_SIZE: usize = 32;
+
+struct CachedStmt {
+    stmt: NonNull<DbStatement>,
+    last_used: u64,
+}
+
+pub struct Sqlite3 {
+    db: NonNull<sqlite3>,
+    stmts: HashMap<String, CachedStmt>,
+    clock: u64,
+}
 unsafe impl Send for Sqlite3 {}
 
+impl Drop for Sqlite3 {
+    fn drop(&mut self) {
+        for (_, cached) in self.stmts.drain() {
+            unsafe { sql_finalize_impl(cached.stmt.as_ptr()) };
+        }
+    }
+}
+
 type SqlBindCallback = Option<unsafe extern "C" fn(*mut c_void, i32, Pin<&mut DbStatement>) -> i32>;
 type SqlExecCallback = Option<unsafe extern "C" fn(*mut c_void, &[String], &DbValues)>;
 
@@ -146,6 +172,146 @@ unsafe extern "C" {
         exec_callback: SqlExecCallback,
         exec_cookie: *mut c_void,
     ) -> i32;
+    fn sql_prepare_impl(db: *mut sqlite3, sql: &str, stmt: *mut *mut DbStatement) -> i32;
+    fn sql_finalize_impl(stmt: *mut DbStatement);
+    fn sql_exec_prepared(
+        stmt: *mut DbStatement,
+        bind_callback: SqlBindCallback,
+        bind_cookie: *mut c_void,
+        exec_callback: SqlExecCallback,
+        exec_cookie: *mut c_void,
+    ) -> i32;
+}
+
+impl Sqlite3 {
+    fn new(db: NonNull<sqlite3>) -> Sqlite3 {
+        Sqlite3 {
+            db,
+            stmts: HashMap::new(),
+            clock: 0,
+        }
+    }
+
+    fn prepare(&mut self, sql: &str) -> Result<Option<NonNull<DbStatement>>, i32> {
+        self.clock += 1;
+        if let Some(cached) = self.stmts.get_mut(sql) {
+            cached.last_used = self.clock;
+            return Ok(Some(cached.stmt));
+        }
+        let mut stmt: *mut DbStatement = ptr::null_mut();
+        let rc = unsafe { sql_prepare_impl(self.db.as_ptr(), sql, &mut stmt) };
+        if rc != 0 {
+            return Err(rc);
+        }
+        // Only single statements can be cached
+        let Some(stmt) = NonNull::new(stmt) else {
+            return Ok(None);
+        };
+        if self.stmts.len() >= STMT_CACHE_SIZE
+            && let Some(lru) = self
+                .stmts
+                .iter()
+                .min_by_key(|(_, c)| c.last_used)
+                .map(|(k, _)| k.clone())
+            && let Some(evicted) = self.stmts.remove(&lru)
+        {
+            unsafe { sql_finalize_impl(evicted.stmt.as_ptr()) };
+        }
+        self.stmts.insert(
+            sql.to_string(),
+            CachedStmt {
+                stmt,
+                last_used: self.clock,
+            },
+        );
+        Ok(Some(stmt))
+    }
+
+    fn exec(
+        &mut self,
+        sql: &str,
+        cache: bool,
+        bind_callback: SqlBindCallback,
+        bind_cookie: *mut c_void,
+        exec_callback: SqlExecCallback,
+        exec_cookie: *mut c_void,
+    ) -> i32 {
+        if cache {
+            match self.prepare(sql) {
+                Ok(Some(stmt)) => {
+                    return unsafe {
+                        sql_exec_prepared(
+                            stmt.as_ptr(),
+                            bind_callback,
+                            bind_cookie,
+                            exec_callback,
+                            exec_cookie,
+                        )
+                    };
+                }
+                Ok(None) => {}
+                Err(rc) => return rc,
+            }
+        }
+        unsafe {
+            sql_exec_impl(
+                self.db.as_ptr(),
+                sql,
+                bind_callback,
+                bind_cookie,
+                exec_callback,
+                exec_cookie,
+            )
+        }
+    }
+}
+
+impl Sqlite3 {
+    fn exec_with_args(
+        &mut self,
+        sql: &str,
+        cache: bool,
+        args: &[DbArg],
+        exec_callback: SqlExecCallback,
+        exec_cookie: *mut c_void,
+    ) -> i32 {
+        let mut bind_callback: SqlBindCallback = None;
+        let mut bind_cookie: *mut c_void = ptr::null_mut();
+        let mut db_args = DbArgs { args, curr: 0 };
+        if !args.is_empty() {
+            bind_callback = Some(bind_arguments);
+            bind_cookie = (&mut db_args) as *mut DbArgs as *mut c_void;
+        }
+        self.exec(
+            sql,
+            cache,
+            bind_callback,
+            bind_cookie,
+            exec_callback,
+            exec_cookie,
+        )
+    }
+}
+
+// All statements executed through this handle are part of a single transaction
+pub struct DbTransaction<'a>(&'a mut Sqlite3);
+
+impl DbTransaction<'_> {
+    pub fn exec(&mut self, sql: &str, args: &[DbArg]) -> SqliteResult<()> {
+        self.0
+            .exec_with_args(sql, true, args, None, ptr::null_mut())
+            .sql_result()
+    }
+}
+
+#[derive(Copy, Clone, PartialEq)]
+enum DbConn {
+    // Read-only connection for queries on hot paths
+    Reader,
+    // Read-write connection with statement caching
+    Writer,
+    // Read-write connection for arbitrary SQL that should not pollute the statement cache
+    Uncached,
 }
 
 pub enum DbArg<'a> {
@@ -186,46 +352,94 @@ unsafe extern "C" fn read_db_row<T: SqlTable>(
 }
 
 impl MagiskD {
-    fn with_db<F: FnOnce(*mut sqlite3) -> i32>(&self, f: F) -> i32 {
+    fn with_db<F: FnOnce(&mut Sqlite3) -> i32>(&self, f: F) -> i32 {
         let mut db = self.sql_connection.lock();
         if db.is_none() {
             let raw_db = open_and_init_db();
-            *db = NonNull::new(raw_db).map(Sqlite3);
+            *db = NonNull::new(raw_db).map(Sqlite3::new);
         }
         match *db {
-            Some(ref mut db) => f(db.0.as_ptr()),
+            Some(ref mut db) => f(db),
             _ => -1,
         }
     }
 
+    fn with_db_reader<F: FnOnce(&mut Sqlite3) -> i32>(&self, f: F) -> i32 {
+        let mut db = self.sql_reader.lock();
+        if db.is_none() {
+            // Make sure the database is created and upgraded before opening as read-only
+            if self.with_db(|_| 0) != 0 {
+                return -1;
+            }
+            let raw_db = open_db_readonly();
+            *db = NonNull::new(raw_db).map(Sqlite3::new);
+        }
+        match *db {
+            Some(ref mut db) => f(db),
+            // Fallback to the main connection
+            _ => self.with_db(f),
+        }
+    }
+
     fn db_exec_impl(
         &self,
+        conn: DbConn,
         sql: &str,
         args: &[DbArg],
         exec_callback: SqlExecCallback,
         exec_cookie: *mut c_void,
     ) -> i32 {
-        let mut bind_callback: SqlBindCallback = None;
-        let mut bind_cookie: *mut c_void = ptr::null_mut();
-        let mut db_args = DbArgs { args, curr: 0 };
-        if !args.is_empty() {
-            bind_callback = Some(bind_arguments);
-            bind_cookie = (&mut db_args) as *mut DbArgs as *mut c_void;
-        }
-        self.with_db(|db| unsafe {
-            sql_exec_impl(
-                db,
+        let f = |db: &mut Sqlite3| {
+            db.exec_with_args(
                 sql,
-                bind_callback,
-                bind_cookie,
+                conn != DbConn::Uncached,
+                args,
                 exec_callback,
                 exec_cookie,
             )
-        })
+        };
+        match conn {
+            DbConn::Reader => self.with_db_reader(f),
+            _ => self.with_db(f),
+        }
     }
 
-    pub fn db_exec_with_rows<T: SqlTable>(&self, sql: &str, args: &[DbArg], out: &mut T) -> i32 {
+    pub fn db_transaction<F>(&self, f: F) -> SqliteResult<()>
+    where
+        F: FnOnce(&mut DbTransaction) -> SqliteResult<()>,
+    {
+        let mut result = Ok(());
+        let rc = self.with_db(|db| {
+            let rc = db.exec_with_args("BEGIN IMMEDIATE", true, &[], None, ptr::null_mut());
+            if rc != 0 {
+                return rc;
+            }
+            result = f(&mut DbTransaction(db));
+            if result.is_ok() {
+                let rc = db.exec_with_args("COMMIT", true, &[], None, ptr::null_mut());
+                if rc == 0 {
+                    return rc;
+                }
+                // A failed COMMIT can leave the transaction open, which would make
+                // every later BEGIN on this connection fail
+                db.exec_with_args("ROLLBACK", true, &[], None, ptr::null_mut());
+                return rc;
+            }
+            db.exec_with_args("ROLLBACK", true, &[], None, ptr::null_mut())
+        });
+        result?;
+        rc.sql_result()
+    }
+
+    fn db_exec_rows_impl<T: SqlTable>(
+        &self,
+        conn: DbConn,
+        sql: &str,
+        args: &[DbArg],
+        out: &mut T,
+    ) -> i32 {
         self.db_exec_impl(
+            conn,
             sql,
             args,
             Some(read_db_row::<T>),
@@ -233,41 +447,110 @@ impl MagiskD {
         )
     }
 
+    // Run read-only queries on a separate connection so they do not contend with writers
+    pub fn db_query_with_rows<T: SqlTable>(&self, sql: &str, args: &[DbArg], out: &mut T) -> i32 {
+        self.db_exec_rows_impl(DbConn::Reader, sql, args, out)
+    }
+
     pub fn db_exec(&self, sql: &str, args: &[DbArg]) -> i32 {
-        self.db_exec_impl(sql, args, None, ptr::null_mut())
+        self.db_exec_impl(DbConn::Writer, sql, args, None, ptr::null_mut())
+    }
+
+    fn load_db_snapshot(&self) -> SqliteResult<DbSnapshot> {
+        let mut settings = HashMap::new();
+        let mut settings_fn = |_: &[String], values: &DbValues| {
+            settings.insert(values.get_text(0).to_string(), values.get_int(1));
+        };
+        self.db_query_with_rows("SELECT key, value FROM settings", &[], &mut settings_fn)
+            .sql_result()?;
+
+        let mut strings = HashMap::new();
+        let mut strings_fn = |_: &[String], values: &DbValues| {
+            strings.insert(
+                values.get_text(0).to_string(),
+                values.get_text(1).to_string(),
+            );
+        };
+        self.db_query_with_rows("SELECT key, value FROM strings", &[], &mut strings_fn)
+            .sql_result()?;
+
+        Ok(DbSnapshot {
+            loaded: true,
+            settings,
+            strings,
+        })
+    }
+
+    pub fn refresh_db_snapshot(&self) -> SqliteResult<Arc<DbSnapshot>> {
+        let _guard = self.db_snapshot_lock.lock();
+        let snapshot = Arc::new(self.load_db_snapshot()?);
+        self.db_snapshot.store(snapshot.clone());
+        Ok(snapshot)
+    }
+
+    fn db_snapshot(&self) -> SqliteResult<Arc<DbSnapshot>> {
+        let snapshot = self.db_snapshot.load();
+        if snapshot.loaded {
+            Ok(snapshot)
+        } else {
+            self.refresh_db_snapshot()
+        }
+    }
+
+    // The write and the snapshot update happen under the same lock, so a concurrent
+    // refresh cannot publish a snapshot that is older than the write.
+    fn write_db_snapshot(
+        &self,
+        write: impl FnOnce() -> SqliteResult<()>,
+        update: impl FnOnce(&mut DbSnapshot),
+    ) -> SqliteResult<()> {
+        let _guard = self.db_snapshot_lock.lock();
+        write()?;
+        let snapshot = self.db_snapshot.load();
+        if !snapshot.loaded {
+            // The full tables will be loaded on the next read
+            return Ok(());
+        }
+        let mut snapshot = DbSnapshot::clone(&snapshot);
+        update(&mut snapshot);
+        self.db_snapshot.store(Arc::new(snapshot));
+        Ok(())
     }
 
     pub fn set_db_setting(&self, key: DbEntryKey, value: i32) -> SqliteResult<()> {
-        self.db_exec(
-            "INSERT OR REPLACE INTO settings (key,value) VALUES(?,?)",
-            &[Text(key.to_str()), Integer(value as i64)],
-        )
-        .sql_result()
+        self.write_db_snapshot(
+            || {
+                self.db_exec(
+                    "INSERT OR REPLACE INTO settings (key,value) VALUES(?,?)",
+                    &[Text(key.to_str()), Integer(value as i64)],
+                )
+                .sql_result()
+            },
+            |s| {
+                s.settings.insert(key.to_str().to_string(), value);
+            },
+        )?;
+        self.invalidate_decision_table();
+        Ok(())
     }
 
     pub fn get_db_setting(&self, key: DbEntryKey) -> i32 {
         // Get default values
-        let mut val = match key {
+        let val = match key {
             DbEntryKey::RootAccess => RootAccess::default() as i32,
             DbEntryKey::SuMultiuserMode => MultiuserMode::default() as i32,
             DbEntryKey::SuMntNs => MntNsMode::default().repr,
             DbEntryKey::DenylistConfig => 0,
             DbEntryKey::ZygiskConfig => self.is_emulator as i32,
             DbEntryKey::BootloopCount => 0,
+            DbEntryKey::LogArchives => DEFAULT_LOG_ARCHIVES,
+            DbEntryKey::ZygiskCost => 0,
             _ => -1,
         };
-        let mut func = |_: &[String], values: &DbValues| {
-            val = values.get_int(0);
-        };
-        self.db_exec_with_rows(
-            "SELECT value FROM settings WHERE key=?",
-            &[Text(key.to_str())],
-            &mut func,
-        )
-        .sql_result()
-        .log()
-        .ok();
-        val
+        match self.db_snapshot().log() {
+            Ok(snapshot) => snapshot.settings.get(key.to_str()).copied().unwrap_or(val),
+            Err(_) => val,
+        }
     }
 
     pub fn get_db_settings(&self) -> SqliteResult<DbSettings> {
@@ -275,30 +558,30 @@ impl MagiskD {
             zygisk: self.is_emulator,
             ..Default::default()
         };
-        self.db_exec_with_rows("SELECT * FROM settings", &[], &mut cfg)
-            .sql_result()?;
+        for (key, value) in &self.db_snapshot()?.settings {
+            cfg.set(key, *value);
+        }
         Ok(cfg)
     }
 
     pub fn get_db_string(&self, key: DbEntryKey) -> String {
-        let mut val = "".to_string();
-        let mut func = |_: &[String], values: &DbValues| {
-            val.push_str(values.get_text(0));
-        };
-        self.db_exec_with_rows(
-            "SELECT value FROM strings WHERE key=?",
-            &[Text(key.to_str())],
-            &mut func,
-        )
-        .sql_result()
-        .log()
-        .ok();
-        val
+        self.db_snapshot()
+            .log()
+            .ok()
+            .and_then(|snapshot| snapshot.strings.get(key.to_str()).cloned())
+            .unwrap_or_default()
     }
 
     pub fn rm_db_string(&self, key: DbEntryKey) -> SqliteResult<()> {
-        self.db_exec("DELETE FROM strings WHERE key=?", &[Text(key.to_str())])
-            .sql_result()
+        self.write_db_snapshot(
+            || {
+                self.db_exec("DELETE FROM strings WHERE key=?", &[Text(key.to_str())])
+                    .sql_result()
+            },
+            |s| {
+                s.strings.remove(key.to_str());
+            },
+        )
     }
 
     pub fn db_exec_for_cli(&self, mut file: UnixStream) -> LoggedResult<()> {
@@ -317,7 +600,10 @@ impl MagiskD {
             }
             writer.write_encodable(&out).log_ok();
         };
-        self.db_exec_with_rows(&sql, &[], &mut output_fn);
+        self.db_exec_rows_impl(DbConn::Uncached, &sql, &[], &mut output_fn);
+        // The SQL could have modified anything, reload the snapshot
+        self.refresh_db_snapshot().log_ok();
+        self.invalidate_decision_table();
         writer.write_encodable("").log()
     }
 }
@@ -337,10 +623,12 @@ unsafe extern "C" fn sql_exec_for_cxx(
     exec_cookie: *mut c_void,
 ) -> i32 {
     unsafe {
+        // SQL from C++ is built with string formatting, caching it would only
+        // push the statements that are actually reused out of the cache.
         MAGISKD.get().unwrap_unchecked().with_db(|db| {
-            sql_exec_impl(
-                db,
+            db.exec(
                 sql,
+                false,
                 bind_callback,
                 bind_cookie,
                 exec_callback,
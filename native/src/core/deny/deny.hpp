@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string_view>
+#include <sys/types.h>
 
 #define ISOLATED_MAGIC "isolated"
 
@@ -40,5 +41,11 @@ int rm_list(int client);
 void ls_list(int client);
 
 bool proc_context_match(int pid, std::string_view context);
+// Whether any process of the UID can be a denylist target
+bool is_deny_uid(int uid);
 void *logcat(void *arg);
 extern bool logcat_exit;
+
+// Revert the mounts of a process once it has left the zygote mount namespace.
+// If stopped is set, the process is resumed with SIGCONT afterwards.
+void queue_unmount(int pid, int uid, std::string_view proc, ino_t zygote_ns, bool stopped);
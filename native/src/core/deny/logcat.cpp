@@ -1,6 +1,11 @@
 #include <unistd.h>
+#include <poll.h>
 #include <android/log.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 #include <string>
 #include <map>
 
@@ -159,12 +164,7 @@ static void process_main_buffer(struct log_msg *msg) {
     if (is_deny_target(entry.uid, cmdline)) {
         int pid = msg->entry.pid;
         kill(pid, SIGSTOP);
-        if (fork_dont_care() == 0) {
-            LOGI("logcat: revert [%s] PID=[%d] UID=[%d]\n", cmdline, pid, entry.uid);
-            revert_unmount(pid);
-            kill(pid, SIGCONT);
-            _exit(0);
-        }
+        queue_unmount(pid, entry.uid, cmdline, 0, true);
     } else {
         LOGD("logcat: skip [%s] PID=[%d] UID=[%d]\n", cmdline, msg->entry.pid, entry.uid);
     }
@@ -180,44 +180,15 @@ static void process_events_buffer(struct log_msg *msg) {
                                 am_proc_start->process_name.length);
         if (is_deny_target(am_proc_start->uid.data, proc)) {
             int pid = am_proc_start->pid.data;
-            if (fork_dont_care() == 0) {
-                int ppid = parse_ppid(pid);
-                auto it = zygote_map.find(ppid);
-                if (it == zygote_map.end()) {
-                    LOGW("logcat: skip [%.*s] PID=[%d] UID=[%d] PPID=[%d]; parent not zygote\n",
-                         (int) proc.length(), proc.data(),
-                         pid, am_proc_start->uid.data, ppid);
-                    _exit(0);
-                }
-
-                char path[16];
-                ssprintf(path, sizeof(path), "/proc/%d", pid);
-                struct stat st{};
-                int fd = syscall(__NR_pidfd_open, pid, 0);
-                if (fd > 0 && setns(fd, CLONE_NEWNS) == 0) {
-                    pid = getpid();
-                } else {
-                    close(fd);
-                    fd = -1;
-                }
-                while (read_ns(pid, &st) == 0 && it->second.st_ino == st.st_ino) {
-                    if (stat(path, &st) == 0 && st.st_uid == 0) {
-                        usleep(10 * 1000);
-                    } else {
-                        LOGW("logcat: skip [%.*s] PID=[%s] UID=[%d]; namespace not isolated\n",
-                             (int) proc.length(), proc.data(),
-                             path + 6, am_proc_start->uid.data);
-                        _exit(0);
-                    }
-                    if (fd > 0) setns(fd, CLONE_NEWNS);
-                }
-                close(fd);
-
-                LOGI("logcat: revert [%.*s] PID=[%d] UID=[%d]\n",
-                     (int) proc.length(), proc.data(), pid, am_proc_start->uid.data);
-                revert_unmount(pid);
-                _exit(0);
+            int ppid = parse_ppid(pid);
+            auto it = zygote_map.find(ppid);
+            if (it == zygote_map.end()) {
+                LOGW("logcat: skip [%.*s] PID=[%d] UID=[%d] PPID=[%d]; parent not zygote\n",
+                     (int) proc.length(), proc.data(),
+                     pid, am_proc_start->uid.data, ppid);
+                return;
             }
+            queue_unmount(pid, am_proc_start->uid.data, proc, it->second.st_ino, false);
         } else {
             LOGD("logcat: skip [%.*s] PID=[%d] UID=[%d]\n",
                  (int) proc.length(), proc.data(),
@@ -273,7 +244,244 @@ static void process_events_buffer(struct log_msg *msg) {
     pthread_exit(nullptr);
 }
 
+// Process event connector backend: app processes are noticed when zygote changes their UID,
+// and checked against the denylist once their process name is set. No log parsing involved.
+
+// The COMM event can arrive before cmdline is rewritten. In that case the candidate is
+// checked again every COMM_RECHECK_MS, up to COMM_RECHECK_MAX times.
+#define COMM_RECHECK_MS  2
+#define COMM_RECHECK_MAX 25
+
+struct proc_candidate {
+    int uid;
+    // The name inherited from the parent, the process is not specialized while it stays the same
+    string inherited;
+    // Rechecks left after a COMM event that did not change cmdline yet
+    int rechecks = 0;
+};
+
+static int64_t now_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static bool read_cmdline(int pid, char *buf, size_t len) {
+    char path[32];
+    ssprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    auto f = open_file(path, "re");
+    if (!f || fgets(buf, len, f.get()) == nullptr)
+        return false;
+    return true;
+}
+
+static int open_proc_connector() {
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0)
+        return -1;
+
+    sockaddr_nl addr{};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Events are dropped if we fall behind, give the socket some room
+    int rcvbuf = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+    // Wake up periodically to notice DenyList being disabled
+    timeval tv{ .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    constexpr size_t payload = sizeof(cn_msg) + sizeof(proc_cn_mcast_op);
+    alignas(nlmsghdr) char buf[NLMSG_SPACE(payload)]{};
+    auto nl = reinterpret_cast<nlmsghdr *>(buf);
+    nl->nlmsg_len = NLMSG_LENGTH(payload);
+    nl->nlmsg_type = NLMSG_DONE;
+    auto cn = reinterpret_cast<cn_msg *>(NLMSG_DATA(nl));
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(proc_cn_mcast_op);
+    *reinterpret_cast<proc_cn_mcast_op *>(cn->data) = PROC_CN_MCAST_LISTEN;
+    if (send(fd, buf, nl->nlmsg_len, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Subscribing succeeds even if the kernel has no process events, make sure they arrive
+    if (fork_dont_care() == 0)
+        _exit(0);
+    if (recv(fd, buf, sizeof(buf), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void revert_proc(int pid, int uid, const char *proc) {
+    kill(pid, SIGSTOP);
+    // Zygote separates the mount namespace before changing the UID, so the
+    // process is either already isolated, or will never be.
+    auto it = zygote_map.find(parse_ppid(pid));
+    ino_t zygote_ns = it == zygote_map.end() ? 0 : it->second.st_ino;
+    queue_unmount(pid, uid, proc, zygote_ns, true);
+}
+
+// Returns true if the candidate is done with, either checked or gone
+static bool resolve_candidate(int pid, const proc_candidate &candidate) {
+    char cmdline[1024];
+    if (!read_cmdline(pid, cmdline, sizeof(cmdline)))
+        return true;
+    string_view proc = cmdline;
+    // The process name is not applied yet
+    if (proc == candidate.inherited || proc.starts_with("usap") || proc == "<pre-initialized>")
+        return false;
+    if (is_deny_target(candidate.uid, proc)) {
+        revert_proc(pid, candidate.uid, cmdline);
+    } else {
+        LOGD("proc_monitor: skip [%s] PID=[%d] UID=[%d]\n", cmdline, pid, candidate.uid);
+    }
+    return true;
+}
+
+// Returns true if any candidate still has to be checked again. Once out of rechecks,
+// a candidate waits for its next COMM event.
+static bool recheck_candidates(map<int, proc_candidate> &candidates) {
+    bool pending = false;
+    for (auto it = candidates.begin(); it != candidates.end();) {
+        auto &candidate = it->second;
+        if (candidate.rechecks > 0 && resolve_candidate(it->first, candidate)) {
+            it = candidates.erase(it);
+            continue;
+        }
+        if (candidate.rechecks > 0 && --candidate.rechecks > 0)
+            pending = true;
+        ++it;
+    }
+    return pending;
+}
+
+// Returns true if a candidate has to be checked again later
+static bool process_proc_event(const proc_event *ev, map<int, proc_candidate> &candidates) {
+    static bool zygote_died = false;
+    char cmdline[1024];
+
+    switch (ev->what) {
+    case proc_event::PROC_EVENT_UID: {
+        const auto &id = ev->event_data.id;
+        int uid = id.e.euid;
+        if (id.process_pid != id.process_tgid || to_app_id(uid) < 10000)
+            return false;
+        if (zygote_died) {
+            check_zygote();
+            zygote_died = zygote_map.empty();
+        }
+        if (!is_deny_uid(uid) || !read_cmdline(id.process_tgid, cmdline, sizeof(cmdline))) {
+            candidates.erase(id.process_tgid);
+            return false;
+        }
+        // Entries of processes whose exit we missed should never pile up
+        if (candidates.size() >= 1024)
+            candidates.clear();
+        candidates[id.process_tgid] = { uid, cmdline };
+        break;
+    }
+    case proc_event::PROC_EVENT_COMM: {
+        auto it = candidates.find(ev->event_data.comm.process_tgid);
+        if (it == candidates.end())
+            return false;
+        if (resolve_candidate(it->first, it->second)) {
+            candidates.erase(it);
+            return false;
+        }
+        it->second.rechecks = COMM_RECHECK_MAX;
+        return true;
+    }
+    case proc_event::PROC_EVENT_EXIT: {
+        int pid = ev->event_data.exit.process_tgid;
+        candidates.erase(pid);
+        if (zygote_map.erase(pid)) {
+            LOGD("proc_monitor: zygote PID=[%d] died\n", pid);
+            zygote_died = true;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return false;
+}
+
+// Returns if the process event connector is not available or fails, the caller then
+// falls back to parsing logs
+static void proc_monitor() {
+    int fd = open_proc_connector();
+    if (fd < 0) {
+        PLOGE("proc_monitor: connector");
+        return;
+    }
+    LOGD("proc_monitor: start\n");
+
+    map<int, proc_candidate> candidates;
+    alignas(nlmsghdr) char buf[8192];
+    // When to check pending candidates again, -1 if there are none
+    int64_t next_recheck = -1;
+    while (denylist_enforced) {
+        if (next_recheck >= 0) {
+            pollfd pfd = { fd, POLLIN, 0 };
+            int64_t now = now_ms();
+            int ret = now >= next_recheck ? 0 : poll(&pfd, 1, next_recheck - now);
+            if (ret == 0)
+                next_recheck = recheck_candidates(candidates) ? now_ms() + COMM_RECHECK_MS : -1;
+            if (ret < 0 && errno != EINTR) {
+                PLOGE("proc_monitor: poll");
+                break;
+            }
+            if (ret <= 0)
+                continue;
+        }
+        sockaddr_nl addr{};
+        socklen_t addr_len = sizeof(addr);
+        int len = recvfrom(fd, buf, sizeof(buf), 0,
+                           reinterpret_cast<sockaddr *>(&addr), &addr_len);
+        if (len < 0) {
+            // ENOBUFS means some events are lost, nothing we can do about it
+            if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS)
+                continue;
+            PLOGE("proc_monitor: recv");
+            break;
+        }
+        // Only trust messages from the kernel
+        if (addr.nl_pid != 0)
+            continue;
+
+        for (auto nl = reinterpret_cast<nlmsghdr *>(buf); NLMSG_OK(nl, len);
+             nl = NLMSG_NEXT(nl, len)) {
+            if (nl->nlmsg_type != NLMSG_DONE)
+                continue;
+            auto cn = reinterpret_cast<const cn_msg *>(NLMSG_DATA(nl));
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+            if (process_proc_event(reinterpret_cast<const proc_event *>(cn->data), candidates) &&
+                next_recheck < 0)
+                next_recheck = now_ms() + COMM_RECHECK_MS;
+        }
+    }
+    close(fd);
+
+    if (denylist_enforced) {
+        LOGW("proc_monitor: connector failed, fallback to logcat\n");
+        return;
+    }
+    LOGD("proc_monitor: terminate\n");
+    pthread_exit(nullptr);
+}
+
 void *logcat(void *) {
     check_zygote();
+    // Fallback to parsing logs if the kernel is built without CONFIG_PROC_EVENTS
+    proc_monitor();
     run();
 }
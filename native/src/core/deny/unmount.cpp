@@ -0,0 +1,232 @@
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <core.hpp>
+
+#include "deny.hpp"
+
+using namespace std;
+
+// Processes waiting for their mounts to be reverted are tracked by a single reactor thread.
+// It waits for them to leave the zygote mount namespace with exponential backoff, and hands
+// them over to a small pool of workers that switch into the target namespace to unmount.
+
+#define UNMOUNT_WORKERS      2
+#define NS_WAIT_MIN_US       500
+#define NS_WAIT_MAX_US       (32 * 1000)
+#define NS_WAIT_TIMEOUT_US   (5 * 1000 * 1000)
+
+struct unmount_job {
+    int pid;
+    int uid;
+    int pidfd;        // -1 if pidfd_open is not supported
+    string proc;
+    ino_t zygote_ns;  // 0 if the process does not have to leave the zygote namespace first
+    bool stopped;     // Has to be resumed once done
+    int64_t queued;
+    int64_t next_check;
+    int64_t delay;
+};
+
+static pthread_mutex_t unmount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+// Jobs submitted to the reactor
+static vector<unmount_job> incoming;
+// Jobs ready to be unmounted
+static deque<unmount_job> ready;
+static int reactor_fd = -1;
+
+static int64_t now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void finish_job(unmount_job &job) {
+    if (job.stopped)
+        kill(job.pid, SIGCONT);
+    if (job.pidfd >= 0)
+        close(job.pidfd);
+}
+
+static void *unmount_worker(void *) {
+    // Switching mount namespace is only allowed if fs attributes are not shared with other threads
+    if (unshare(CLONE_FS) < 0) {
+        PLOGE("unmount: unshare");
+        return nullptr;
+    }
+    int self_ns = xopen("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+
+    while (true) {
+        unmount_job job;
+        {
+            mutex_guard lock(unmount_lock);
+            while (ready.empty())
+                pthread_cond_wait(&worker_cond, &unmount_lock);
+            job = std::move(ready.front());
+            ready.pop_front();
+        }
+
+        int ns = job.pidfd;
+        if (ns < 0 || setns(ns, CLONE_NEWNS) < 0) {
+            char path[32];
+            ssprintf(path, sizeof(path), "/proc/%d/ns/mnt", job.pid);
+            ns = open(path, O_RDONLY | O_CLOEXEC);
+            if (ns < 0 || setns(ns, CLONE_NEWNS) < 0) {
+                if (ns >= 0)
+                    close(ns);
+                finish_job(job);
+                continue;
+            }
+            close(ns);
+        }
+
+        revert_unmount();
+        setns(self_ns, CLONE_NEWNS);
+
+        int64_t latency = now_us() - job.queued;
+        record_unmount_latency(latency);
+        LOGI("denylist: revert [%s] PID=[%d] UID=[%d] in %lldus\n",
+             job.proc.data(), job.pid, job.uid, static_cast<long long>(latency));
+        finish_job(job);
+    }
+}
+
+// Returns true if the job is done waiting, either ready or dropped
+static bool check_job(unmount_job &job, int64_t now) {
+    char path[32];
+    struct stat st{};
+    ssprintf(path, sizeof(path), "/proc/%d/ns/mnt", job.pid);
+    if (stat(path, &st) != 0) {
+        // Process died
+        finish_job(job);
+        return true;
+    }
+    if (job.zygote_ns == 0 || st.st_ino != job.zygote_ns) {
+        mutex_guard lock(unmount_lock);
+        ready.push_back(std::move(job));
+        pthread_cond_signal(&worker_cond);
+        return true;
+    }
+    // Still in the zygote namespace, keep waiting only if it is not specialized yet
+    ssprintf(path, sizeof(path), "/proc/%d", job.pid);
+    if (stat(path, &st) != 0 || st.st_uid != 0 || now - job.queued > NS_WAIT_TIMEOUT_US) {
+        LOGW("denylist: skip [%s] PID=[%d] UID=[%d]; namespace not isolated\n",
+             job.proc.data(), job.pid, job.uid);
+        finish_job(job);
+        return true;
+    }
+    job.next_check = now + job.delay;
+    job.delay = std::min(job.delay * 2, static_cast<int64_t>(NS_WAIT_MAX_US));
+    return false;
+}
+
+static void *unmount_reactor(void *) {
+    vector<unmount_job> pending;
+    vector<pollfd> pfds;
+
+    while (true) {
+        // Check all due jobs and find out how long we can sleep
+        int64_t now = now_us();
+        int64_t next = -1;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->next_check <= now && check_job(*it, now)) {
+                it = pending.erase(it);
+                continue;
+            }
+            if (next < 0 || it->next_check < next)
+                next = it->next_check;
+            ++it;
+        }
+
+        pfds.clear();
+        pfds.push_back({ .fd = reactor_fd, .events = POLLIN });
+        for (const auto &job : pending) {
+            // pidfd becomes readable when the process exits
+            if (job.pidfd >= 0)
+                pfds.push_back({ .fd = job.pidfd, .events = POLLIN });
+        }
+
+        timespec ts{};
+        timespec *timeout = nullptr;
+        if (next >= 0) {
+            int64_t wait = std::max(next - now_us(), static_cast<int64_t>(0));
+            ts.tv_sec = wait / 1000000;
+            ts.tv_nsec = (wait % 1000000) * 1000;
+            timeout = &ts;
+        }
+        if (ppoll(pfds.data(), pfds.size(), timeout, nullptr) < 0 && errno != EINTR) {
+            PLOGE("unmount: ppoll");
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            eventfd_t val;
+            eventfd_read(reactor_fd, &val);
+            mutex_guard lock(unmount_lock);
+            for (auto &job : incoming)
+                pending.push_back(std::move(job));
+            incoming.clear();
+        }
+        for (size_t i = 1; i < pfds.size(); ++i) {
+            if (pfds[i].revents == 0)
+                continue;
+            auto it = std::find_if(pending.begin(), pending.end(),
+                                   [&](const auto &job) { return job.pidfd == pfds[i].fd; });
+            if (it != pending.end()) {
+                finish_job(*it);
+                pending.erase(it);
+            }
+        }
+    }
+}
+
+static bool start_unmount_threads() {
+    reactor_fd = eventfd(0, EFD_CLOEXEC);
+    if (reactor_fd < 0) {
+        PLOGE("unmount: eventfd");
+        return false;
+    }
+    for (int i = 0; i < UNMOUNT_WORKERS; ++i) {
+        if (new_daemon_thread(&unmount_worker))
+            return false;
+    }
+    return new_daemon_thread(&unmount_reactor) == 0;
+}
+
+void queue_unmount(int pid, int uid, std::string_view proc, ino_t zygote_ns, bool stopped) {
+    static bool started = start_unmount_threads();
+    if (!started) {
+        // Should never happen, but the process must not stay stopped
+        if (stopped)
+            kill(pid, SIGCONT);
+        return;
+    }
+
+    int64_t now = now_us();
+    unmount_job job{
+        .pid = pid,
+        .uid = uid,
+        .pidfd = static_cast<int>(syscall(__NR_pidfd_open, pid, 0)),
+        .proc = string(proc),
+        .zygote_ns = zygote_ns,
+        .stopped = stopped,
+        .queued = now,
+        .next_check = now,
+        .delay = NS_WAIT_MIN_US,
+    };
+    {
+        mutex_guard lock(unmount_lock);
+        incoming.push_back(std::move(job));
+    }
+    eventfd_write(reactor_fd, 1);
+}
@@ -4,8 +4,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <algorithm>
 #include <set>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include <consts.hpp>
 #include <sqlite.hpp>
@@ -29,19 +32,46 @@ static unique_ptr<map<int, set<string_view>>> app_id_to_pkgs_;
 // Locks the data structures above
 static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
 
-atomic<bool> denylist_enforced = false;
+// Immutable lookup index built from the data structures above.
+// It is replaced as a whole on every change so matching never takes data_lock.
+class DenyIndex {
+public:
+    DenyIndex(const vector<pair<int, string_view>> &targets,
+              const set<string, StringCmp> &isolated);
+
+    bool match(int app_id, string_view process) const;
+    bool match_isolated(string_view process) const;
+    bool has_app_id(int app_id) const;
+    bool has_isolated() const { return trie[0].child != 0; }
+
+private:
+    struct Slot {
+        int app_id;  // 0 marks an empty slot
+        uint32_t hash;
+        uint32_t offset;
+        uint32_t len;
+    };
+
+    // Prefix trie stored as first-child/next-sibling links, node 0 is the root
+    struct TrieNode {
+        uint32_t child;
+        uint32_t sibling;
+        char c;
+        bool terminal;
+    };
+
+    static uint32_t hash(int app_id, string_view process);
+    void insert_prefix(string_view prefix);
+
+    vector<Slot> slots;  // Open addressing with linear probing, size is a power of 2
+    string names;
+    vector<int> app_ids;  // Sorted
+    vector<TrieNode> trie;
+};
+
+static shared_ptr<const DenyIndex> deny_index;
 
-static int get_app_id(const vector<int> &users, const string &pkg) {
-    struct stat st{};
-    char buf[PATH_MAX];
-    for (const auto &user_id: users) {
-        ssprintf(buf, sizeof(buf), "%s/%d/%s", APP_DATA_DIR, user_id, pkg.data());
-        if (stat(buf, &st) == 0) {
-            return to_app_id(st.st_uid);
-        }
-    }
-    return 0;
-}
+atomic<bool> denylist_enforced = false;
 
 static void collect_users(vector<int> &users) {
     auto data_dir = xopen_dir(APP_DATA_DIR);
@@ -56,23 +86,38 @@ static void collect_users(vector<int> &users) {
 static int get_app_id(const string &pkg) {
     if (pkg == ISOLATED_MAGIC)
         return -1;
+    if (int app_id = MagiskD::Get().get_package_app_id(pkg); app_id >= 0)
+        return app_id;
+
+    // packages.list is not available, look for the data directory instead
     vector<int> users;
     collect_users(users);
-    return get_app_id(users, pkg);
+    struct stat st{};
+    char buf[PATH_MAX];
+    for (const auto &user_id: users) {
+        ssprintf(buf, sizeof(buf), "%s/%d/%s", APP_DATA_DIR, user_id, pkg.data());
+        if (stat(buf, &st) == 0) {
+            return to_app_id(st.st_uid);
+        }
+    }
+    return 0;
 }
 
-static void update_app_id(int app_id, const string &pkg, bool remove) {
-    if (app_id <= 0)
-        return;
-    if (remove) {
-        if (auto it = app_id_to_pkgs.find(app_id); it != app_id_to_pkgs.end()) {
-            it->second.erase(pkg);
-            if (it->second.empty()) {
-                app_id_to_pkgs.erase(it);
-            }
-        }
-    } else {
+static void update_app_id(int app_id, const string &pkg) {
+    if (app_id > 0)
         app_id_to_pkgs[app_id].emplace(pkg);
+}
+
+// Drop every app ID reference to a package. Has to be done before its pkg_to_procs
+// entry is erased, as app_id_to_pkgs holds string_views into the keys.
+static void forget_pkg(string_view pkg) {
+    for (auto it = app_id_to_pkgs.begin(); it != app_id_to_pkgs.end();) {
+        it->second.erase(pkg);
+        if (it->second.empty()) {
+            it = app_id_to_pkgs.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
@@ -91,6 +136,109 @@ static void crawl_procfs(const F &fn) {
     }
 }
 
+uint32_t DenyIndex::hash(int app_id, string_view process) {
+    // FNV-1a
+    uint32_t h = 0x811c9dc5;
+    auto mix = [&](uint8_t b) {
+        h ^= b;
+        h *= 0x01000193;
+    };
+    for (size_t i = 0; i < sizeof(app_id); ++i)
+        mix(static_cast<uint32_t>(app_id) >> (i * 8));
+    for (char c : process)
+        mix(c);
+    return h;
+}
+
+DenyIndex::DenyIndex(const vector<pair<int, string_view>> &targets,
+                     const set<string, StringCmp> &isolated) {
+    size_t size = 16;
+    while (size < targets.size() * 2)
+        size <<= 1;
+    slots.resize(size);
+    for (const auto &[app_id, process] : targets) {
+        uint32_t h = hash(app_id, process);
+        size_t idx = h & (size - 1);
+        while (slots[idx].app_id != 0)
+            idx = (idx + 1) & (size - 1);
+        slots[idx] = { app_id, h, static_cast<uint32_t>(names.size()),
+                       static_cast<uint32_t>(process.size()) };
+        names.append(process);
+        app_ids.push_back(app_id);
+    }
+    ranges::sort(app_ids);
+    app_ids.erase(ranges::unique(app_ids).begin(), app_ids.end());
+
+    trie.push_back({});
+    for (const auto &prefix : isolated) {
+        insert_prefix(prefix);
+    }
+}
+
+void DenyIndex::insert_prefix(string_view prefix) {
+    uint32_t node = 0;
+    for (char c : prefix) {
+        uint32_t child = trie[node].child;
+        while (child != 0 && trie[child].c != c)
+            child = trie[child].sibling;
+        if (child == 0) {
+            child = trie.size();
+            trie.push_back({ 0, trie[node].child, c, false });
+            trie[node].child = child;
+        }
+        node = child;
+    }
+    trie[node].terminal = true;
+}
+
+bool DenyIndex::match(int app_id, string_view process) const {
+    uint32_t h = hash(app_id, process);
+    for (size_t idx = h & (slots.size() - 1);; idx = (idx + 1) & (slots.size() - 1)) {
+        const auto &slot = slots[idx];
+        if (slot.app_id == 0)
+            return false;
+        if (slot.hash == h && slot.app_id == app_id &&
+            string_view(names).substr(slot.offset, slot.len) == process)
+            return true;
+    }
+}
+
+bool DenyIndex::has_app_id(int app_id) const {
+    return ranges::binary_search(app_ids, app_id);
+}
+
+bool DenyIndex::match_isolated(string_view process) const {
+    uint32_t node = 0;
+    for (char c : process) {
+        if (trie[node].terminal)
+            return true;
+        uint32_t child = trie[node].child;
+        while (child != 0 && trie[child].c != c)
+            child = trie[child].sibling;
+        if (child == 0)
+            return false;
+        node = child;
+    }
+    return trie[node].terminal;
+}
+
+// Has to be called with data_lock held
+static void rebuild_index() {
+    vector<pair<int, string_view>> targets;
+    for (const auto &[app_id, pkgs] : app_id_to_pkgs) {
+        for (const auto &pkg : pkgs) {
+            for (const auto &proc : pkg_to_procs.find(pkg)->second) {
+                targets.emplace_back(app_id, proc);
+            }
+        }
+    }
+    static const set<string, StringCmp> empty;
+    auto it = pkg_to_procs.find(ISOLATED_MAGIC);
+    const auto &isolated = it == pkg_to_procs.end() ? empty : it->second;
+    atomic_store(&deny_index, make_shared<const DenyIndex>(targets, isolated));
+    MagiskD::Get().invalidate_decision_table();
+}
+
 static bool str_eql(string_view a, string_view b) { return a == b; }
 static bool str_starts_with(string_view a, string_view b) { return a.starts_with(b); }
 
@@ -182,21 +330,20 @@ static bool add_hide_set(const char *pkg, const char *proc) {
     return true;
 }
 
-void scan_deny_apps() {
+// Has to be called with data_lock held
+static void rescan_deny_apps() {
     if (!app_id_to_pkgs_)
         return;
 
     app_id_to_pkgs.clear();
 
     char sql[4096];
-    vector<int> users;
-    collect_users(users);
     for (auto it = pkg_to_procs.begin(); it != pkg_to_procs.end();) {
         if (it->first == ISOLATED_MAGIC) {
             it++;
             continue;
         }
-        int app_id = get_app_id(users, it->first);
+        int app_id = get_app_id(it->first);
         if (app_id == 0) {
             LOGI("denylist rm: [%s]\n", it->first.data());
             ssprintf(sql, sizeof(sql), "DELETE FROM denylist WHERE package_name='%s'",
@@ -204,15 +351,51 @@ void scan_deny_apps() {
             db_exec(sql);
             it = pkg_to_procs.erase(it);
         } else {
-            update_app_id(app_id, it->first, false);
+            update_app_id(app_id, it->first);
             it++;
         }
     }
+    rebuild_index();
+}
+
+void scan_deny_apps() {
+    mutex_guard lock(data_lock);
+    rescan_deny_apps();
+}
+
+void update_deny_packages(const rust::Vec<PackageChange> &changes) {
+    mutex_guard lock(data_lock);
+    // Everything will be resolved when the data is loaded
+    if (!pkg_to_procs_ || !app_id_to_pkgs_)
+        return;
+
+    bool updated = false;
+    char sql[4096];
+    for (const auto &change : changes) {
+        auto it = pkg_to_procs.find(string_view(change.pkg.data(), change.pkg.size()));
+        if (it == pkg_to_procs.end())
+            continue;
+        updated = true;
+        // The package may still be mapped under an app ID other than old_app_id
+        forget_pkg(it->first);
+        if (change.new_app_id == 0) {
+            LOGI("denylist rm: [%s]\n", it->first.data());
+            ssprintf(sql, sizeof(sql), "DELETE FROM denylist WHERE package_name='%s'",
+                     it->first.data());
+            db_exec(sql);
+            pkg_to_procs.erase(it);
+        } else {
+            update_app_id(change.new_app_id, it->first);
+        }
+    }
+    if (updated)
+        rebuild_index();
 }
 
 static void clear_data() {
     pkg_to_procs_.reset(nullptr);
     app_id_to_pkgs_.reset(nullptr);
+    atomic_store(&deny_index, shared_ptr<const DenyIndex>());
 }
 
 static bool ensure_data() {
@@ -239,7 +422,7 @@ static bool ensure_data() {
         goto error;
 
     default_new(app_id_to_pkgs_);
-    scan_deny_apps();
+    rescan_deny_apps();
 
     return true;
 
@@ -265,7 +448,8 @@ static int add_list(const char *pkg, const char *proc) {
         if (!add_hide_set(pkg, proc))
             return DenyResponse::ITEM_EXIST;
         auto it = pkg_to_procs.find(pkg);
-        update_app_id(app_id, it->first, false);
+        update_app_id(app_id, it->first);
+        rebuild_index();
     }
 
     // Add to database
@@ -292,7 +476,7 @@ static int rm_list(const char *pkg, const char *proc) {
         auto it = pkg_to_procs.find(pkg);
         if (it != pkg_to_procs.end()) {
             if (proc[0] == '\0') {
-                update_app_id(get_app_id(pkg), it->first, true);
+                forget_pkg(it->first);
                 pkg_to_procs.erase(it);
                 remove = true;
                 LOGI("denylist rm: [%s]\n", pkg);
@@ -300,7 +484,7 @@ static int rm_list(const char *pkg, const char *proc) {
                 remove = true;
                 LOGI("denylist rm: [%s/%s]\n", pkg, proc);
                 if (it->second.empty()) {
-                    update_app_id(get_app_id(pkg), it->first, true);
+                    forget_pkg(it->first);
                     pkg_to_procs.erase(it);
                 }
             }
@@ -308,6 +492,7 @@ static int rm_list(const char *pkg, const char *proc) {
 
         if (!remove)
             return DenyResponse::ITEM_NOT_EXIST;
+        rebuild_index();
     }
 
     char sql[4096];
@@ -333,7 +518,7 @@ void ls_list(int client) {
             return;
         }
 
-        scan_deny_apps();
+        rescan_deny_apps();
         write_int(client,static_cast<int>(DenyResponse::OK));
 
         for (const auto &[pkg, procs] : pkg_to_procs) {
@@ -369,10 +554,12 @@ int enable_deny() {
             return DenyResponse::ERROR;
 
         denylist_enforced = true;
+        MagiskD::Get().invalidate_decision_table();
 
         if (!MagiskD::Get().zygisk_enabled()) {
             if (new_daemon_thread(&logcat)) {
                 denylist_enforced = false;
+                MagiskD::Get().invalidate_decision_table();
                 return DenyResponse::ERROR;
             }
         }
@@ -392,6 +579,7 @@ int enable_deny() {
 int disable_deny() {
     if (denylist_enforced.exchange(false)) {
         LOGI("* Disable DenyList\n");
+        MagiskD::Get().invalidate_decision_table();
     }
     MagiskD::Get().set_db_setting(DbEntryKey::DenylistConfig, false);
     return DenyResponse::OK;
@@ -405,36 +593,40 @@ void initialize_denylist() {
 }
 
 bool is_deny_target(int uid, string_view process) {
-    mutex_guard lock(data_lock);
-    if (!ensure_data())
-        return false;
+    auto index = atomic_load(&deny_index);
+    if (!index) {
+        mutex_guard lock(data_lock);
+        if (!ensure_data())
+            return false;
+        index = atomic_load(&deny_index);
+        if (!index)
+            return false;
+    }
 
     int app_id = to_app_id(uid);
     if (app_id >= 90000) {
-        if (auto it = pkg_to_procs.find(ISOLATED_MAGIC); it != pkg_to_procs.end()) {
-            for (const auto &s : it->second) {
-                if (process.starts_with(s))
-                    return true;
-            }
-        }
-        return false;
+        return index->match_isolated(process);
     } else {
-        auto it = app_id_to_pkgs.find(app_id);
-        if (it == app_id_to_pkgs.end())
-            return false;
-        for (const auto &pkg : it->second) {
-            if (pkg_to_procs.find(pkg)->second.count(process))
-                return true;
-        }
+        return index->match(app_id, process);
     }
-    return false;
 }
 
-void update_deny_flags(int uid, rust::Str process, uint32_t &flags) {
-    if (is_deny_target(uid, { process.begin(), process.end() })) {
-        flags |= +ZygiskStateFlags::ProcessOnDenyList;
-    }
-    if (denylist_enforced) {
-        flags |= +ZygiskStateFlags::DenyListEnforced;
-    }
+bool is_deny_uid(int uid) {
+    auto index = atomic_load(&deny_index);
+    // Without an index, leave the decision to is_deny_target
+    if (!index)
+        return true;
+    int app_id = to_app_id(uid);
+    return app_id >= 90000 ? index->has_isolated() : index->has_app_id(app_id);
+}
+
+bool load_deny_index() {
+    if (atomic_load(&deny_index))
+        return true;
+    mutex_guard lock(data_lock);
+    return ensure_data() && atomic_load(&deny_index);
+}
+
+bool is_denylist_enforced() {
+    return denylist_enforced;
 }
@@ -79,13 +79,18 @@ void initialize_denylist();
 void scan_deny_apps();
 bool is_deny_target(int uid, std::string_view process);
 void revert_unmount(int pid = -1) noexcept;
-void update_deny_flags(int uid, rust::Str process, uint32_t &flags);
+bool load_deny_index();
+void update_deny_packages(const rust::Vec<PackageChange> &changes);
+bool is_denylist_enforced();
 
 // MagiskSU
 void exec_root_shell(int client, int pid, SuRequest &req, MntNsMode mode);
 
 // Rust bindings
 inline Utf8CStr get_magisk_tmp_rs() { return get_magisk_tmp(); }
+inline bool is_deny_target_rs(int uid, rust::Str process) {
+    return is_deny_target(uid, { process.data(), process.size() });
+}
 inline rust::String resolve_preinit_dir_rs(Utf8CStr base_dir) {
     return resolve_preinit_dir(base_dir.c_str());
 }
@@ -4,6 +4,7 @@
 
 #include <rust/cxx.h>
 
+#define SQLITE_OPEN_READONLY         0x00000001  /* Ok for sqlite3_open_v2() */
 #define SQLITE_OPEN_READWRITE        0x00000002  /* Ok for sqlite3_open_v2() */
 #define SQLITE_OPEN_CREATE           0x00000004  /* Ok for sqlite3_open_v2() */
 #define SQLITE_OPEN_NOMUTEX          0x00008000  /* Ok for sqlite3_open_v2() */
@@ -35,6 +36,7 @@ using sql_bind_callback = int(*)(void*, int, DbStatement&);
 using sql_exec_callback = void(*)(void*, StringSlice, const DbValues&);
 
 sqlite3 *open_and_init_db();
+sqlite3 *open_db_readonly();
 
 /************
  * C++ APIs *
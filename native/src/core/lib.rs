@@ -12,17 +12,21 @@ use crate::ffi::SuRequest;
 use crate::socket::Encodable;
 use base::derive::Decodable;
 use daemon::{MagiskD, connect_daemon_for_cxx};
-use logging::{android_logging, zygisk_close_logd, zygisk_get_logd, zygisk_logging};
+use logging::{
+    android_logging, zygisk_close_logd, zygisk_get_logd, zygisk_logging, zygisk_send_cost_record,
+};
 use magisk::magisk_main;
-use mount::revert_unmount;
+use mount::{prepare_unmount_plan, revert_unmount};
 use resetprop::{get_prop, resetprop_main};
 use selinux::{lgetfilecon, setfilecon};
+use stats::record_unmount_latency;
 use socket::{recv_fd, recv_fds, send_fd};
 use std::fs::File;
 use std::mem::ManuallyDrop;
 use std::ops::DerefMut;
 use std::os::fd::FromRawFd;
 use su::{get_pty_num, pump_tty};
+use timeline::{boot_time_ms, record_boot_script};
 use zygisk::zygisk_should_load_module;
 
 mod bootstages;
@@ -38,8 +42,10 @@ mod package;
 mod resetprop;
 mod selinux;
 mod socket;
+mod stats;
 mod su;
 mod thread;
+mod timeline;
 mod zygisk;
 
 #[allow(clippy::needless_lifetimes)]
@@ -60,6 +66,9 @@ pub mod ffi {
         SQLITE_CMD,
         REMOVE_MODULES,
         ZYGISK,
+        GET_STATS,
+        IMPORT_POLICIES,
+        EXPORT_POLICIES,
 
         _STAGE_BARRIER_,
 
@@ -87,6 +96,8 @@ pub mod ffi {
         ZygiskConfig,
         BootloopCount,
         SuManager,
+        LogArchives,
+        ZygiskCost,
     }
 
     #[repr(i32)]
@@ -104,6 +115,20 @@ pub mod ffi {
         Restrict,
     }
 
+    // How a boot script ended up, as recorded in the boot timeline
+    enum ScriptResult {
+        // Waited for until it exited
+        Exited,
+        // Still running when the time to wait for it ran out
+        Timeout,
+        // Started after the blocking phase ended, never waited for
+        Detached,
+        // Could not be started
+        Failed,
+        // Runs in the background by design
+        Async,
+    }
+
     struct ModuleInfo {
         name: String,
         z32: i32,
@@ -115,6 +140,7 @@ pub mod ffi {
         GetInfo,
         ConnectCompanion,
         GetModDir,
+        GetFlagsMap,
     }
 
     #[repr(u32)]
@@ -125,6 +151,13 @@ pub mod ffi {
         ProcessIsMagiskApp = 0x80000000,
     }
 
+    // app_id == 0 means the package is not installed
+    struct PackageChange {
+        pkg: String,
+        old_app_id: i32,
+        new_app_id: i32,
+    }
+
     #[derive(Decodable)]
     struct SuRequest {
         target_uid: i32,
@@ -150,7 +183,6 @@ pub mod ffi {
         fn resolve_preinit_dir(base_dir: Utf8CStrRef) -> String;
         fn check_key_combo() -> bool;
         fn unlock_blocks();
-        fn update_deny_flags(uid: i32, process: &str, flags: &mut u32);
         fn initialize_denylist();
         fn switch_mnt_ns(pid: i32) -> i32;
         fn exec_root_shell(client: i32, pid: i32, req: &mut SuRequest, mode: MntNsMode);
@@ -167,6 +199,11 @@ pub mod ffi {
         fn denylist_cli(args: &mut Vec<String>) -> i32;
         fn denylist_handler(client: i32);
         fn scan_deny_apps();
+        fn load_deny_index() -> bool;
+        #[cxx_name = "is_deny_target_rs"]
+        fn is_deny_target(uid: i32, process: &str) -> bool;
+        fn is_denylist_enforced() -> bool;
+        fn update_deny_packages(changes: &Vec<PackageChange>);
 
         include!("include/sqlite.hpp");
 
@@ -176,6 +213,7 @@ pub mod ffi {
 
         fn sqlite3_errstr(code: i32) -> *const c_char;
         fn open_and_init_db() -> *mut sqlite3;
+        fn open_db_readonly() -> *mut sqlite3;
         fn get_int(self: &DbValues, index: i32) -> i32;
         #[cxx_name = "get_str"]
         fn get_text(self: &DbValues, index: i32) -> &str;
@@ -188,7 +226,18 @@ pub mod ffi {
         fn zygisk_logging();
         fn zygisk_close_logd();
         fn zygisk_get_logd() -> i32;
+        fn zygisk_send_cost_record(record: &[u8]);
         fn revert_unmount(pid: i32);
+        fn prepare_unmount_plan();
+        fn record_unmount_latency(us: u64);
+        fn boot_time_ms() -> i64;
+        fn record_boot_script(
+            stage: Utf8CStrRef,
+            name: &str,
+            start_ms: i64,
+            result: ScriptResult,
+            status: i32,
+        );
         fn zygisk_should_load_module(flags: u32) -> bool;
         fn send_fd(socket: i32, fd: i32) -> bool;
         fn recv_fd(socket: i32) -> i32;
@@ -222,6 +271,8 @@ pub mod ffi {
         fn get_db_setting(&self, key: DbEntryKey) -> i32;
         #[cxx_name = "set_db_setting"]
         fn set_db_setting_for_cxx(&self, key: DbEntryKey, value: i32) -> bool;
+        fn invalidate_decision_table(&self);
+        fn get_package_app_id(&self, pkg: &str) -> i32;
 
         #[Self = MagiskD]
         #[cxx_name = "Get"]
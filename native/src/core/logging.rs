@@ -1,29 +1,29 @@
 use crate::consts::{LOG_PIPE, LOGFILE};
-use crate::ffi::get_magisk_tmp;
+use crate::daemon::MagiskD;
+use crate::ffi::{DbEntryKey, get_magisk_tmp};
 use crate::logging::LogFile::{Actual, Buffer};
-use base::const_format::concatcp;
+use crate::zygisk::record_specialize_cost;
 use base::{
-    FsPathBuilder, LogLevel, LoggedResult, ReadExt, ResultExt, Utf8CStr, Utf8CStrBuf, WriteExt,
-    cstr, libc, new_daemon_thread, raw_cstr, update_logger,
+    FsPathBuilder, LogLevel, LoggedResult, ResultExt, Utf8CStr, Utf8CStrBuf, WriteExt, cstr, libc,
+    new_daemon_thread, raw_cstr, update_logger,
 };
-use bytemuck::{Pod, Zeroable, bytes_of, write_zeroes};
+use bytemuck::{Pod, Zeroable, bytes_of};
 use libc::{PIPE_BUF, c_char, localtime_r, sigtimedwait, time_t, timespec, tm};
-use nix::fcntl::OFlag;
+use nix::fcntl::{FcntlArg, OFlag, fcntl};
 use nix::sys::signal::{SigSet, SigmaskHow, Signal};
 use nix::unistd::{Gid, Uid, chown, getpid, gettid};
 use num_derive::{FromPrimitive, ToPrimitive};
 use num_traits::FromPrimitive;
 use std::cmp::min;
+use std::collections::VecDeque;
 use std::fmt::Write as _;
 use std::fs::File;
 use std::io::{IoSlice, Read, Write};
 use std::mem::ManuallyDrop;
-use std::os::fd::{FromRawFd, IntoRawFd, RawFd};
+use std::os::fd::{AsRawFd, FromRawFd, IntoRawFd, RawFd};
 use std::ptr::null_mut;
-use std::sync::Arc;
 use std::sync::atomic::{AtomicI32, Ordering};
-use std::sync::nonpoison::Mutex;
-use std::time::{Duration, SystemTime, UNIX_EPOCH};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
 use std::{fs, io};
 
 #[allow(dead_code, non_camel_case_types)]
@@ -92,21 +92,28 @@ struct LogMeta {
 
 const MAX_MSG_LEN: usize = PIPE_BUF - size_of::<LogMeta>();
 
-fn write_log_to_pipe(mut logd: &File, prio: i32, msg: &Utf8CStr) -> io::Result<usize> {
-    // Truncate message if needed
-    let len = min(MAX_MSG_LEN, msg.len());
-    let msg = &msg.as_bytes()[..len];
+// Records that are not log messages are marked with a negative prio.
+// Sets up the log file, len is the number of log archives to keep.
+const LOG_SETUP_FILE: i32 = -1;
+// Specialization cost reported by zygisk, see zygisk/cost.rs
+const LOG_ZYGISK_COST: i32 = -2;
 
+// Writes a single record, data has to fit in PIPE_BUF with the header to stay atomic
+fn write_record(mut logd: &File, prio: i32, data: &[u8]) -> io::Result<usize> {
     let meta = LogMeta {
         prio,
-        len: len as i32,
+        len: data.len() as i32,
         pid: getpid().as_raw(),
         tid: gettid().as_raw(),
     };
 
     let io1 = IoSlice::new(bytes_of(&meta));
-    let io2 = IoSlice::new(msg);
-    let result = logd.write_vectored(&[io1, io2]);
+    let io2 = IoSlice::new(data);
+    logd.write_vectored(&[io1, io2])
+}
+
+fn write_to_pipe(logd: &File, prio: i32, data: &[u8]) -> io::Result<usize> {
+    let result = write_record(logd, prio, data);
     if let Err(ref e) = result {
         let mut buf = cstr::buf::new::<256>();
         write!(buf, "Cannot write_log_to_pipe: {e}").ok();
@@ -115,15 +122,27 @@ fn write_log_to_pipe(mut logd: &File, prio: i32, msg: &Utf8CStr) -> io::Result<u
     result
 }
 
-static MAGISK_LOGD_FD: Mutex<Option<Arc<File>>> = Mutex::new(None);
+fn write_log_to_pipe(logd: &File, prio: i32, msg: &Utf8CStr) -> io::Result<usize> {
+    // Truncate message if needed
+    let len = min(MAX_MSG_LEN, msg.len());
+    write_to_pipe(logd, prio, &msg.as_bytes()[..len])
+}
+
+// The write end of the log pipe. Once published it is never closed, so loggers
+// can use it without taking a lock or a reference. Writes up to PIPE_BUF are
+// atomic, the kernel takes care of concurrent writers.
+static MAGISK_LOGD_FD: AtomicI32 = AtomicI32::new(-1);
 
 fn with_logd_fd<R, F: FnOnce(&File) -> io::Result<R>>(f: F) {
-    let fd = MAGISK_LOGD_FD.lock().clone();
-    if let Some(logd) = fd
-        && f(&logd).is_err()
-    {
-        // If any error occurs, shut down the logd pipe
-        *MAGISK_LOGD_FD.lock() = None;
+    let fd = MAGISK_LOGD_FD.load(Ordering::Acquire);
+    if fd < 0 {
+        return;
+    }
+    let logd = ManuallyDrop::new(unsafe { File::from_raw_fd(fd) });
+    if f(&logd).is_err() {
+        // If any error occurs, shut down the logd pipe. The fd is leaked on purpose,
+        // other threads could still be writing to it.
+        MAGISK_LOGD_FD.store(-1, Ordering::Release);
     }
 }
 
@@ -175,20 +194,23 @@ pub fn zygisk_get_logd() -> i32 {
     raw_fd
 }
 
-fn zygisk_log_to_pipe(prio: i32, msg: &Utf8CStr) {
+fn zygisk_write_to_pipe(prio: i32, data: &[u8]) {
     let fd = zygisk_get_logd();
     if fd < 0 {
         // Cannot talk to pipe, abort
         return;
     }
+    zygisk_write_to_fd(fd, prio, data);
+}
 
+fn zygisk_write_to_fd(fd: RawFd, prio: i32, data: &[u8]) {
     // Block SIGPIPE
     let mut mask = SigSet::empty();
     mask.add(Signal::SIGPIPE);
     let orig_mask = mask.thread_swap_mask(SigmaskHow::SIG_SETMASK);
 
     let logd = ManuallyDrop::new(unsafe { File::from_raw_fd(fd) });
-    let result = write_log_to_pipe(&logd, prio, msg);
+    let result = write_to_pipe(&logd, prio, data);
 
     // Consume SIGPIPE if exists, then restore mask
     if let Ok(orig_mask) = orig_mask {
@@ -207,11 +229,107 @@ fn zygisk_log_to_pipe(prio: i32, msg: &Utf8CStr) {
     }
 }
 
+fn zygisk_log_to_pipe(prio: i32, msg: &Utf8CStr) {
+    // Truncate message if needed
+    let len = min(MAX_MSG_LEN, msg.len());
+    zygisk_write_to_pipe(prio, &msg.as_bytes()[..len]);
+}
+
+// Only uses the pipe opened by zygote before the secontext transition. A specialized
+// process is not allowed to open the FIFO, so the record is dropped if it is gone.
+pub fn zygisk_send_cost_record(record: &[u8]) {
+    let fd = ZYGISK_LOGD.load(Ordering::Relaxed);
+    // Records are never truncated, they have to be written in one piece
+    if fd >= 0 && record.len() <= MAX_MSG_LEN {
+        zygisk_write_to_fd(fd, LOG_ZYGISK_COST, record);
+    }
+}
+
 // The following is implementation for the logging daemon
 
+// Logs received before /cache is ready are kept in memory, only the latest ones are preserved
+const EARLY_LOG_SIZE: usize = 256 * 1024;
+// The log file is archived once it grows beyond this size
+const LOG_ROTATE_SIZE: u64 = 2 * 1024 * 1024;
+// Number of archived log files kept around, configurable with the log_archives setting
+pub const DEFAULT_LOG_ARCHIVES: i32 = 1;
+const MAX_LOG_ARCHIVES: i32 = 9;
+
+#[derive(Default)]
+struct EarlyLogs {
+    buf: VecDeque<u8>,
+    dropped: usize,
+}
+
+impl Write for EarlyLogs {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        self.buf.extend(data);
+        if self.buf.len() > EARLY_LOG_SIZE {
+            // Drop the oldest lines, never leave a partial line at the front
+            let excess = self.buf.len() - EARLY_LOG_SIZE;
+            let cut = self
+                .buf
+                .range(excess..)
+                .position(|b| *b == b'\n')
+                .map_or(self.buf.len(), |pos| excess + pos + 1);
+            self.buf.drain(..cut);
+            self.dropped += cut;
+        }
+        Ok(data.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+struct LogWriter {
+    path: &'static str,
+    file: File,
+    size: u64,
+    archives: i32,
+}
+
+impl Write for LogWriter {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        if self.size >= LOG_ROTATE_SIZE {
+            rotate_logfile(self.path, self.archives);
+            self.file = File::create(self.path)?;
+            self.size = 0;
+        }
+        let len = self.file.write(data)?;
+        self.size += len as u64;
+        Ok(len)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.file.flush()
+    }
+}
+
+fn archive_name(path: &str, idx: i32) -> String {
+    if idx == 0 {
+        format!("{path}.bak")
+    } else {
+        format!("{path}.bak.{idx}")
+    }
+}
+
+// magisk.log -> magisk.log.bak -> magisk.log.bak.1 -> ...
+fn rotate_logfile(path: &str, archives: i32) {
+    if archives <= 0 {
+        fs::remove_file(path).ok();
+        return;
+    }
+    for idx in (1..archives).rev() {
+        fs::rename(archive_name(path, idx - 1), archive_name(path, idx)).ok();
+    }
+    fs::rename(path, archive_name(path, 0)).ok();
+}
+
 enum LogFile {
-    Buffer(Vec<u8>),
-    Actual(File),
+    Buffer(EarlyLogs),
+    Actual(LogWriter),
 }
 
 impl LogFile {
@@ -221,94 +339,232 @@ impl LogFile {
             Actual(e) => e,
         }
     }
-}
 
-fn logfile_write_loop(mut pipe: File) -> io::Result<()> {
-    let mut logfile: LogFile = Buffer(Vec::new());
+    fn switch_to_file(&mut self, path: &'static str, archives: i32) -> io::Result<()> {
+        let archives = archives.clamp(0, MAX_LOG_ARCHIVES);
+        match self {
+            Buffer(early) => {
+                rotate_logfile(path, archives);
+                let mut file = File::create(path)?;
+                if early.dropped > 0 {
+                    writeln!(file, "... {} bytes of early logs dropped", early.dropped)?;
+                }
+                let (a, b) = early.buf.as_slices();
+                file.write_all(a)?;
+                file.write_all(b)?;
+                let size = file.metadata().map_or(0, |m| m.len());
+                *self = Actual(LogWriter {
+                    path,
+                    file,
+                    size,
+                    archives,
+                });
+            }
+            // The setting can change at runtime
+            Actual(writer) => writer.archives = archives,
+        }
+        Ok(())
+    }
+}
 
-    let mut meta = LogMeta::zeroed();
-    let mut msg_buf = [0u8; MAX_MSG_LEN];
-    let mut aux = cstr::buf::new::<64>();
+const LOG_PIPE_SIZE: i32 = 1024 * 1024;
+// The pipe is read in large chunks and messages are framed in the buffer
+const PIPE_READ_SIZE: usize = 64 * 1024;
+// Formatted lines are written out once the pipe is drained, or at the
+// latest when the pending batch gets this large or this old.
+const FLUSH_SIZE: usize = 64 * 1024;
+const FLUSH_INTERVAL: Duration = Duration::from_millis(50);
+
+// localtime_r and strftime only have to run once per second
+#[derive(Default)]
+struct TimeCache {
+    secs: u64,
+    text: String,
+}
 
-    loop {
-        // Read request
-        write_zeroes(&mut meta);
-        pipe.read_pod(&mut meta)?;
-
-        if meta.prio < 0 {
-            if let Buffer(ref mut buf) = logfile {
-                fs::rename(LOGFILE, concatcp!(LOGFILE, ".bak")).ok();
-                let mut out = File::create(LOGFILE)?;
-                out.write_all(buf.as_slice())?;
-                logfile = Actual(out);
+impl TimeCache {
+    fn format(&mut self, secs: u64) -> Option<&str> {
+        if self.text.is_empty() || self.secs != secs {
+            let mut buf = cstr::buf::new::<32>();
+            // Note: the obvious better implementation is to use the rust chrono crate, however
+            // the crate cannot fetch the proper local timezone without pulling in a bunch of
+            // timezone handling code. To reduce binary size, fallback to use localtime_r in libc.
+            unsafe {
+                let secs = secs as time_t;
+                let mut tm: tm = std::mem::zeroed();
+                if localtime_r(&secs, &mut tm).is_null() {
+                    return None;
+                }
+                strftime(buf.as_mut_ptr(), buf.capacity(), raw_cstr!("%m-%d %T"), &tm);
             }
-            continue;
+            buf.rebuild().ok()?;
+            self.text.clear();
+            self.text.push_str(buf.as_str());
+            self.secs = secs;
         }
+        Some(&self.text)
+    }
+}
 
-        if meta.len < 0 || meta.len > MAX_MSG_LEN as i32 {
+fn format_log_line(out: &mut Vec<u8>, time: &mut TimeCache, meta: &LogMeta, msg: &[u8]) {
+    let prio = ALogPriority::from_i32(meta.prio).unwrap_or(ALogPriority::ANDROID_LOG_UNKNOWN);
+    let prio = match prio {
+        ALogPriority::ANDROID_LOG_VERBOSE => 'V',
+        ALogPriority::ANDROID_LOG_DEBUG => 'D',
+        ALogPriority::ANDROID_LOG_INFO => 'I',
+        ALogPriority::ANDROID_LOG_WARN => 'W',
+        ALogPriority::ANDROID_LOG_ERROR => 'E',
+        // Unsupported values, skip
+        _ => return,
+    };
+
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or(Duration::ZERO);
+    let Some(date) = time.format(now.as_secs()) else {
+        return;
+    };
+
+    write!(
+        out,
+        "{date}.{:03} {:5} {:5} {} : ",
+        now.subsec_millis(),
+        meta.pid,
+        meta.tid,
+        prio
+    )
+    .ok();
+    out.extend_from_slice(msg);
+}
+
+fn pipe_has_data(pipe: &File) -> bool {
+    let mut pfd = libc::pollfd {
+        fd: pipe.as_raw_fd(),
+        events: libc::POLLIN,
+        revents: 0,
+    };
+    unsafe { libc::poll(&mut pfd, 1, 0) > 0 }
+}
+
+enum LogRecord<'a> {
+    // Number of log archives to keep
+    SetupFile(i32),
+    ZygiskCost(&'a [u8]),
+    Message(LogMeta, &'a [u8]),
+}
+
+// Calls f for every complete record in buf, and returns the number of bytes consumed.
+// An incomplete record at the end is left for the next call. If the stream is out of
+// sync, everything is consumed.
+fn parse_log_records(
+    buf: &[u8],
+    mut f: impl FnMut(LogRecord) -> io::Result<()>,
+) -> io::Result<usize> {
+    let mut off = 0;
+    while buf.len() - off >= size_of::<LogMeta>() {
+        let meta: LogMeta = bytemuck::pod_read_unaligned(&buf[off..off + size_of::<LogMeta>()]);
+        if meta.prio == LOG_SETUP_FILE {
+            off += size_of::<LogMeta>();
+            f(LogRecord::SetupFile(meta.len))?;
             continue;
         }
+        if meta.len < 0 || meta.len > MAX_MSG_LEN as i32 {
+            // The stream is out of sync, drop everything we have
+            return Ok(buf.len());
+        }
+        let msg_start = off + size_of::<LogMeta>();
+        let msg_end = msg_start + meta.len as usize;
+        if msg_end > buf.len() {
+            break;
+        }
+        let msg = &buf[msg_start..msg_end];
+        if meta.prio == LOG_ZYGISK_COST {
+            f(LogRecord::ZygiskCost(msg))?;
+        } else {
+            f(LogRecord::Message(meta, msg))?;
+        }
+        off = msg_end;
+    }
+    Ok(off)
+}
 
-        // Read the rest of the message
-        let msg = &mut msg_buf[..(meta.len as usize)];
-        pipe.read_exact(msg)?;
-
-        // Start building the log string
-        aux.clear();
-        let prio = ALogPriority::from_i32(meta.prio).unwrap_or(ALogPriority::ANDROID_LOG_UNKNOWN);
-        let prio = match prio {
-            ALogPriority::ANDROID_LOG_VERBOSE => 'V',
-            ALogPriority::ANDROID_LOG_DEBUG => 'D',
-            ALogPriority::ANDROID_LOG_INFO => 'I',
-            ALogPriority::ANDROID_LOG_WARN => 'W',
-            ALogPriority::ANDROID_LOG_ERROR => 'E',
-            // Unsupported values, skip
-            _ => continue,
-        };
-
-        let now = SystemTime::now()
-            .duration_since(UNIX_EPOCH)
-            .unwrap_or(Duration::ZERO);
+// The pipe is read in large chunks, which can end in the middle of a record.
+// The incomplete record is moved to the front of the buffer until the rest arrives.
+struct LogReader {
+    buf: Vec<u8>,
+    pending: usize,
+}
 
-        // Note: the obvious better implementation is to use the rust chrono crate, however
-        // the crate cannot fetch the proper local timezone without pulling in a bunch of
-        // timezone handling code. To reduce binary size, fallback to use localtime_r in libc.
-        unsafe {
-            let secs = now.as_secs() as time_t;
-            let mut tm: tm = std::mem::zeroed();
-            if localtime_r(&secs, &mut tm).is_null() {
-                continue;
-            }
-            strftime(aux.as_mut_ptr(), aux.capacity(), raw_cstr!("%m-%d %T"), &tm);
+impl LogReader {
+    fn new() -> LogReader {
+        LogReader {
+            buf: vec![0u8; PIPE_READ_SIZE],
+            pending: 0,
         }
+    }
 
-        if aux.rebuild().is_ok() {
-            write!(
-                aux,
-                ".{:03} {:5} {:5} {} : ",
-                now.subsec_millis(),
-                meta.pid,
-                meta.tid,
-                prio
-            )
-            .ok();
-        } else {
-            continue;
+    // Reads once from the pipe and calls f for every record that is now complete
+    fn read_records(
+        &mut self,
+        pipe: &mut impl Read,
+        f: impl FnMut(LogRecord) -> io::Result<()>,
+    ) -> io::Result<()> {
+        let len = pipe.read(&mut self.buf[self.pending..])?;
+        if len == 0 {
+            return Err(io::ErrorKind::UnexpectedEof.into());
         }
+        let end = self.pending + len;
+        let off = parse_log_records(&self.buf[..end], f)?;
+        self.buf.copy_within(off..end, 0);
+        self.pending = end - off;
+        Ok(())
+    }
+}
 
-        let io1 = IoSlice::new(aux.as_bytes());
-        let io2 = IoSlice::new(msg);
-        // We don't need to care the written len because we are writing less than PIPE_BUF
-        // It's guaranteed to always write the whole thing atomically
-        let _ = logfile.as_write().write_vectored(&[io1, io2])?;
+fn logfile_write_loop(mut pipe: File) -> io::Result<()> {
+    let mut logfile: LogFile = Buffer(EarlyLogs::default());
+
+    let mut reader = LogReader::new();
+    let mut batch: Vec<u8> = Vec::with_capacity(FLUSH_SIZE + PIPE_BUF);
+    let mut batch_start = Instant::now();
+    let mut time = TimeCache::default();
+
+    loop {
+        reader.read_records(&mut pipe, |record| {
+            match record {
+                LogRecord::SetupFile(archives) => {
+                    logfile.as_write().write_all(&batch)?;
+                    batch.clear();
+                    logfile.switch_to_file(LOGFILE, archives)?;
+                }
+                LogRecord::ZygiskCost(data) => record_specialize_cost(data),
+                LogRecord::Message(meta, msg) => {
+                    if batch.is_empty() {
+                        batch_start = Instant::now();
+                    }
+                    format_log_line(&mut batch, &mut time, &meta, msg);
+                }
+            }
+            Ok(())
+        })?;
+
+        if !batch.is_empty()
+            && (batch.len() >= FLUSH_SIZE
+                || batch_start.elapsed() >= FLUSH_INTERVAL
+                || !pipe_has_data(&pipe))
+        {
+            logfile.as_write().write_all(&batch)?;
+            batch.clear();
+        }
     }
 }
 
 pub fn setup_logfile() {
+    let archives = MagiskD::get().get_db_setting(DbEntryKey::LogArchives);
     with_logd_fd(|mut logd| {
         let meta = LogMeta {
-            prio: -1,
-            len: 0,
+            prio: LOG_SETUP_FILE,
+            len: archives,
             pid: 0,
             tid: 0,
         };
@@ -325,7 +581,7 @@ pub fn start_log_daemon() {
         let file = unsafe { File::from_raw_fd(arg as RawFd) };
         logfile_write_loop(file).ok();
         // If any error occurs, shut down the logd pipe
-        *MAGISK_LOGD_FD.lock() = None;
+        MAGISK_LOGD_FD.store(-1, Ordering::Release);
         0
     }
 
@@ -334,10 +590,321 @@ pub fn start_log_daemon() {
         chown(path.as_utf8_cstr(), Some(Uid::from(0)), Some(Gid::from(0)))?;
         let read = path.open(OFlag::O_RDWR | OFlag::O_CLOEXEC)?;
         let write = path.open(OFlag::O_WRONLY | OFlag::O_CLOEXEC)?;
-        *MAGISK_LOGD_FD.lock() = Some(Arc::new(write));
+        // A larger pipe absorbs bursts of logs without blocking the writers
+        fcntl(&read, FcntlArg::F_SETPIPE_SZ(LOG_PIPE_SIZE)).log_ok();
+        MAGISK_LOGD_FD.store(write.into_raw_fd(), Ordering::Release);
         unsafe {
             new_daemon_thread(logfile_writer_thread, read.into_raw_fd() as usize);
         }
         Ok(())
     }();
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::fd::OwnedFd;
+
+    #[derive(Debug, PartialEq)]
+    enum Record {
+        SetupFile(i32),
+        ZygiskCost(Vec<u8>),
+        Message(i32, Vec<u8>),
+    }
+
+    fn frame(prio: i32, msg: &[u8]) -> Vec<u8> {
+        let meta = LogMeta {
+            prio,
+            len: msg.len() as i32,
+            pid: 1,
+            tid: 2,
+        };
+        let mut frame = bytes_of(&meta).to_vec();
+        frame.extend_from_slice(msg);
+        frame
+    }
+
+    fn setup_frame(archives: i32) -> Vec<u8> {
+        let meta = LogMeta {
+            prio: LOG_SETUP_FILE,
+            len: archives,
+            pid: 0,
+            tid: 0,
+        };
+        bytes_of(&meta).to_vec()
+    }
+
+    fn collect(out: &mut Vec<Record>) -> impl FnMut(LogRecord) -> io::Result<()> + '_ {
+        |record| {
+            out.push(match record {
+                LogRecord::SetupFile(archives) => Record::SetupFile(archives),
+                LogRecord::ZygiskCost(data) => Record::ZygiskCost(data.to_vec()),
+                LogRecord::Message(meta, msg) => Record::Message(meta.prio, msg.to_vec()),
+            });
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn parse_complete_records() {
+        let mut stream = frame(4, b"first\n");
+        stream.extend(setup_frame(3));
+        stream.extend(frame(LOG_ZYGISK_COST, &[1, 2, 3, 4]));
+        stream.extend(frame(6, b""));
+        stream.extend(frame(3, &[b'x'; MAX_MSG_LEN]));
+
+        let mut records = Vec::new();
+        let consumed = parse_log_records(&stream, collect(&mut records)).unwrap();
+        assert_eq!(consumed, stream.len());
+        assert_eq!(
+            records,
+            [
+                Record::Message(4, b"first\n".to_vec()),
+                Record::SetupFile(3),
+                Record::ZygiskCost(vec![1, 2, 3, 4]),
+                Record::Message(6, Vec::new()),
+                Record::Message(3, vec![b'x'; MAX_MSG_LEN]),
+            ]
+        );
+    }
+
+    #[test]
+    fn keep_partial_records() {
+        let first = frame(4, b"hello\n");
+        let second = frame(5, b"world\n");
+        let stream = [first.as_slice(), second.as_slice()].concat();
+
+        for cut in 0..=stream.len() {
+            let mut records = Vec::new();
+            let consumed = parse_log_records(&stream[..cut], collect(&mut records)).unwrap();
+            let expected = if cut == stream.len() {
+                2
+            } else if cut >= first.len() {
+                1
+            } else {
+                0
+            };
+            assert_eq!(records.len(), expected, "cut at {cut}");
+            let expected_len = [0, first.len(), stream.len()][expected];
+            assert_eq!(consumed, expected_len, "cut at {cut}");
+        }
+    }
+
+    #[test]
+    fn drop_out_of_sync_stream() {
+        for len in [-1, MAX_MSG_LEN as i32 + 1] {
+            let meta = LogMeta {
+                prio: 4,
+                len,
+                pid: 1,
+                tid: 2,
+            };
+            let mut stream = frame(4, b"valid\n");
+            stream.extend_from_slice(bytes_of(&meta));
+            stream.extend(frame(4, b"lost\n"));
+
+            let mut records = Vec::new();
+            let consumed = parse_log_records(&stream, collect(&mut records)).unwrap();
+            assert_eq!(consumed, stream.len());
+            assert_eq!(records, [Record::Message(4, b"valid\n".to_vec())]);
+        }
+    }
+
+    // Returns the data in chunks of the given sizes, like a pipe read racing its writers
+    struct ChunkedReader<'a> {
+        data: &'a [u8],
+        sizes: &'a [usize],
+        idx: usize,
+    }
+
+    impl Read for ChunkedReader<'_> {
+        fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+            let size = self.sizes[self.idx % self.sizes.len()];
+            self.idx += 1;
+            let len = size.min(buf.len()).min(self.data.len());
+            buf[..len].copy_from_slice(&self.data[..len]);
+            self.data = &self.data[len..];
+            Ok(len)
+        }
+    }
+
+    #[test]
+    fn reader_reassembles_split_records() {
+        let mut stream = Vec::new();
+        let mut expected = Vec::new();
+        for i in 0..2000 {
+            let msg = vec![b'a' + (i % 26) as u8; (i * 37) % (MAX_MSG_LEN + 1)];
+            stream.extend(frame(3 + (i % 4) as i32, &msg));
+            expected.push(Record::Message(3 + (i % 4) as i32, msg));
+        }
+
+        let mut pipe = ChunkedReader {
+            data: &stream,
+            sizes: &[1, 7, 15, 16, 17, 4096, 3, PIPE_READ_SIZE],
+            idx: 0,
+        };
+        let mut reader = LogReader::new();
+        let mut records = Vec::new();
+        let err = loop {
+            if let Err(e) = reader.read_records(&mut pipe, collect(&mut records)) {
+                break e;
+            }
+        };
+        assert_eq!(err.kind(), io::ErrorKind::UnexpectedEof);
+        assert_eq!(reader.pending, 0);
+        assert!(records == expected);
+    }
+
+    #[test]
+    fn early_logs_keep_latest_lines() {
+        let mut early = EarlyLogs::default();
+        let mut written = 0;
+        let mut last = String::new();
+        for i in 0.. {
+            last = format!("line {i:06}\n");
+            early.write_all(last.as_bytes()).unwrap();
+            written += last.len();
+            if written > EARLY_LOG_SIZE * 3 {
+                break;
+            }
+        }
+        let buf: Vec<u8> = early.buf.iter().copied().collect();
+        assert!(buf.len() <= EARLY_LOG_SIZE);
+        assert_eq!(early.dropped + buf.len(), written);
+        // Only whole lines are dropped
+        assert!(buf.starts_with(b"line "));
+        assert!(buf.ends_with(last.as_bytes()));
+    }
+
+    #[test]
+    fn early_logs_drop_oversized_line() {
+        let mut early = EarlyLogs::default();
+        early.write_all(b"short\n").unwrap();
+        early.write_all(&vec![b'x'; EARLY_LOG_SIZE + 1]).unwrap();
+        // No line boundary to cut at, nothing partial is kept
+        assert!(early.buf.is_empty());
+        assert_eq!(early.dropped, EARLY_LOG_SIZE + 7);
+        early.write_all(b"next\n").unwrap();
+        assert!(early.buf.iter().eq(b"next\n"));
+    }
+
+    fn temp_log(name: &str) -> &'static str {
+        let dir = std::env::temp_dir().join(format!("magisk-log-{name}-{}", std::process::id()));
+        fs::remove_dir_all(&dir).ok();
+        fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("magisk.log").to_string_lossy().into_owned();
+        Box::leak(path.into_boxed_str())
+    }
+
+    fn read(path: &str) -> Option<String> {
+        fs::read_to_string(path).ok()
+    }
+
+    #[test]
+    fn rotate_keeps_archives() {
+        let path = temp_log("rotate");
+        for i in 0..5 {
+            fs::write(path, i.to_string()).unwrap();
+            rotate_logfile(path, 3);
+        }
+        assert_eq!(read(path), None);
+        assert_eq!(read(&archive_name(path, 0)).as_deref(), Some("4"));
+        assert_eq!(read(&archive_name(path, 1)).as_deref(), Some("3"));
+        assert_eq!(read(&archive_name(path, 2)).as_deref(), Some("2"));
+        assert_eq!(read(&archive_name(path, 3)), None);
+
+        fs::write(path, "5").unwrap();
+        rotate_logfile(path, 0);
+        assert_eq!(read(path), None);
+        // Existing archives are left alone
+        assert_eq!(read(&archive_name(path, 0)).as_deref(), Some("4"));
+    }
+
+    #[test]
+    fn writer_rotates_by_size() {
+        let path = temp_log("writer");
+        fs::write(path, "previous boot\n").unwrap();
+
+        let mut logfile = Buffer(EarlyLogs::default());
+        logfile.as_write().write_all(b"early\n").unwrap();
+        logfile.switch_to_file(path, 1).unwrap();
+        assert_eq!(
+            read(&archive_name(path, 0)).as_deref(),
+            Some("previous boot\n")
+        );
+        assert_eq!(read(path).as_deref(), Some("early\n"));
+
+        let Actual(writer) = &mut logfile else {
+            panic!("log file is not set up");
+        };
+        assert_eq!(writer.size, 6);
+        writer.write_all(b"more\n").unwrap();
+        assert_eq!(read(path).as_deref(), Some("early\nmore\n"));
+
+        writer.size = LOG_ROTATE_SIZE;
+        writer.write_all(b"rotated\n").unwrap();
+        assert_eq!(writer.size, 8);
+        assert_eq!(
+            read(&archive_name(path, 0)).as_deref(),
+            Some("early\nmore\n")
+        );
+        assert_eq!(read(path).as_deref(), Some("rotated\n"));
+        assert_eq!(read(&archive_name(path, 1)), None);
+    }
+
+    // Writes from many threads race on the pipe, every record has to come out intact
+    // and in order per thread.
+    #[test]
+    fn concurrent_writers_keep_records_intact() {
+        const THREADS: usize = 16;
+        const MESSAGES: usize = 2000;
+
+        let (mut pipe, writer) = io::pipe().unwrap();
+        let writer = File::from(OwnedFd::from(writer));
+        let reader = std::thread::spawn(move || {
+            let mut reader = LogReader::new();
+            let mut records = Vec::new();
+            let err = loop {
+                if let Err(e) = reader.read_records(&mut pipe, collect(&mut records)) {
+                    break e;
+                }
+            };
+            assert_eq!(err.kind(), io::ErrorKind::UnexpectedEof);
+            records
+        });
+
+        std::thread::scope(|s| {
+            for thread in 0..THREADS {
+                let writer = &writer;
+                s.spawn(move || {
+                    for seq in 0..MESSAGES {
+                        let mut msg = format!("{thread} {seq} ").into_bytes();
+                        let len = (thread * 131 + seq * 17) % MAX_MSG_LEN;
+                        msg.resize(len.max(msg.len()), b'a' + thread as u8);
+                        let written = write_record(writer, 4, &msg).unwrap();
+                        assert_eq!(written, size_of::<LogMeta>() + msg.len());
+                    }
+                });
+            }
+        });
+        drop(writer);
+
+        let records = reader.join().unwrap();
+        assert_eq!(records.len(), THREADS * MESSAGES);
+        let mut next_seq = [0; THREADS];
+        for record in records {
+            let Record::Message(4, msg) = record else {
+                panic!("unexpected record");
+            };
+            let msg = String::from_utf8(msg).unwrap();
+            let mut fields = msg.splitn(3, ' ');
+            let thread: usize = fields.next().unwrap().parse().unwrap();
+            let seq: usize = fields.next().unwrap().parse().unwrap();
+            let fill = b'a' + thread as u8;
+            assert!(fields.next().unwrap().bytes().all(|b| b == fill));
+            assert_eq!(seq, next_seq[thread]);
+            next_seq[thread] += 1;
+        }
+        assert!(next_seq.iter().all(|n| *n == MESSAGES));
+    }
+}
@@ -4,10 +4,13 @@ use crate::ffi::{RequestCode, denylist_cli, get_magisk_tmp, install_module, unlo
 use crate::mount::find_preinit_device;
 use crate::selinux::restorecon;
 use crate::socket::{Decodable, Encodable};
+use crate::su::SuPolicyRow;
+use crate::timeline::print_boot_timeline;
 use argh::FromArgs;
-use base::{CmdArgs, EarlyExitExt, LoggedResult, Utf8CString, argh, clone_attr};
+use base::{CmdArgs, EarlyExitExt, LoggedResult, Utf8CString, argh, clone_attr, log_err};
 use nix::poll::{PollFd, PollFlags, PollTimeout};
 use std::ffi::c_char;
+use std::io::{BufReader, BufWriter, Write, stdin, stdout};
 use std::os::fd::AsFd;
 use std::process::exit;
 
@@ -39,6 +42,16 @@ Advanced Options (Internal APIs):
    --path                    print Magisk tmpfs mount path
    --denylist ARGS           denylist config CLI
    --preinit-device          resolve a device to store preinit files
+   --stats [--trace]         dump daemon runtime statistics, or timing events
+                             in Chrome trace format (trace builds only)
+   --stats --zygisk          dump the cost of zygisk and each module on
+                             app and system_server specialization, only
+                             recorded with the zygisk_cost setting enabled
+   --boot-timeline           show boot stage and module script timings of
+                             recent boots
+   --import-policies         import su policies from stdin, one per line:
+                             "uid policy until logging notification"
+   --export-policies         export all su policies to stdout
 
 Available applets:
      {}
@@ -76,6 +89,10 @@ enum MagiskAction {
     Path(PathCmd),
     DenyList(DenyList),
     PreInitDevice(PreInitDevice),
+    Stats(StatsCmd),
+    BootTimeline(BootTimeline),
+    ImportPolicies(ImportPolicies),
+    ExportPolicies(ExportPolicies),
 }
 
 #[derive(FromArgs)]
@@ -180,6 +197,27 @@ struct DenyList {
 #[argh(subcommand, name = "--preinit-device")]
 struct PreInitDevice {}
 
+#[derive(FromArgs)]
+#[argh(subcommand, name = "--stats")]
+struct StatsCmd {
+    #[argh(switch, long = "trace")]
+    trace: bool,
+    #[argh(switch, long = "zygisk")]
+    zygisk: bool,
+}
+
+#[derive(FromArgs)]
+#[argh(subcommand, name = "--boot-timeline")]
+struct BootTimeline {}
+
+#[derive(FromArgs)]
+#[argh(subcommand, name = "--import-policies")]
+struct ImportPolicies {}
+
+#[derive(FromArgs)]
+#[argh(subcommand, name = "--export-policies")]
+struct ExportPolicies {}
+
 impl MagiskAction {
     fn exec(self) -> LoggedResult<i32> {
         use MagiskAction::*;
@@ -280,6 +318,51 @@ impl MagiskAction {
                     println!("{name}");
                 }
             }
+            BootTimeline(_) => print_boot_timeline(),
+            Stats(StatsCmd { trace, zygisk }) => {
+                let mut fd = connect_daemon(RequestCode::GET_STATS, false)?;
+                trace.encode(&mut fd)?;
+                zygisk.encode(&mut fd)?;
+                loop {
+                    let line = String::decode(&mut fd)?;
+                    if line.is_empty() {
+                        return Ok(0);
+                    }
+                    println!("{line}");
+                }
+            }
+            ImportPolicies(_) => {
+                let mut rows = Vec::new();
+                for line in stdin().lines() {
+                    let line = line?;
+                    let line = line.trim();
+                    if line.is_empty() || line.starts_with('#') {
+                        continue;
+                    }
+                    match SuPolicyRow::parse(line) {
+                        Some(row) => rows.push(row),
+                        None => return log_err!("Invalid policy: {line}"),
+                    }
+                }
+                let mut fd = connect_daemon(RequestCode::IMPORT_POLICIES, false)?;
+                {
+                    let mut writer = BufWriter::new(&mut fd);
+                    rows.encode(&mut writer)?;
+                    writer.flush()?;
+                }
+                if i32::decode(&mut fd)? < 0 {
+                    return Ok(1);
+                }
+            }
+            ExportPolicies(_) => {
+                let mut fd = connect_daemon(RequestCode::EXPORT_POLICIES, false)?;
+                let mut reader = BufReader::new(&mut fd);
+                let mut out = BufWriter::new(stdout().lock());
+                while bool::decode(&mut reader)? {
+                    let row = SuPolicyRow::decode(&mut reader)?;
+                    writeln!(out, "{row}")?;
+                }
+            }
         };
         Ok(0)
     }
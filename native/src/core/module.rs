@@ -3,6 +3,8 @@ use crate::daemon::MagiskD;
 use crate::ffi::{ModuleInfo, exec_module_scripts, exec_script, get_magisk_tmp};
 use crate::mount::setup_module_mount;
 use crate::resetprop::load_prop_file;
+use crate::stats::{Stage, span};
+use crate::timeline::boot_phase;
 use base::{
     DirEntry, Directory, FsPathBuilder, LoggedResult, OsResult, ResultExt, SilentLogExt, Utf8CStr,
     Utf8CStrBuf, Utf8CString, WalkResult, clone_attr, cstr, debug, error, info, libc, raw_cstr,
@@ -822,15 +824,26 @@ fn collect_modules(zygisk_enabled: bool, open_zygisk: bool) -> Vec<ModuleInfo> {
 impl MagiskD {
     pub fn handle_modules(&self) {
         setup_module_mount();
-        upgrade_modules().ok();
+        {
+            let _phase = boot_phase("post-fs-data", "module_upgrade");
+            upgrade_modules().ok();
+        }
 
         let zygisk = self.zygisk_enabled.load(Ordering::Acquire);
         let modules = collect_modules(zygisk, false);
-        exec_module_scripts(cstr!("post-fs-data"), &modules);
+        {
+            let _span = span(Stage::ModuleScripts);
+            let _phase = boot_phase("post-fs-data", "module_scripts");
+            exec_module_scripts(cstr!("post-fs-data"), &modules);
+        }
 
         // Recollect modules (module scripts could remove itself)
         let modules = collect_modules(zygisk, true);
-        self.apply_modules(&modules);
+        {
+            let _span = span(Stage::ModuleMount);
+            let _phase = boot_phase("post-fs-data", "module_mount");
+            self.apply_modules(&modules);
+        }
 
         self.module_list.set(modules).ok();
     }
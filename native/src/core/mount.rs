@@ -2,16 +2,20 @@ use crate::consts::{MODULEMNT, MODULEROOT, PREINITDEV, PREINITMIRR, WORKERDIR};
 use crate::ffi::{get_magisk_tmp, resolve_preinit_dir, switch_mnt_ns};
 use crate::resetprop::get_prop;
 use base::{
-    FsPathBuilder, LibcReturn, LoggedResult, MountInfo, ResultExt, Utf8CStr, Utf8CStrBuf, cstr,
-    debug, info, libc, parse_mount_info, warn,
+    FsPathBuilder, LibcReturn, LoggedResult, MountInfo, MountInfoTable, ResultExt, Utf8CStr,
+    Utf8CStrBuf, Utf8CString, cstr, debug, info, libc, parse_mount_info, warn,
 };
 use libc::{c_uint, dev_t, major};
 use nix::mount::MsFlags;
 use nix::sys::stat::{Mode, SFlag, mknod};
+use nix::unistd::gettid;
 use num_traits::AsPrimitive;
 use std::cmp::Ordering::{Greater, Less};
 use std::ffi::OsStr;
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::nonpoison::Mutex;
 
 // Linux allocated devices: 240-254 are reserved for LOCAL/EXPERIMENTAL use.
 const DYNAMIC_MAJOR_MIN: u32 = 240;
@@ -36,13 +40,13 @@ pub fn setup_preinit_dir() {
         let mnt_path = cstr::buf::default()
             .join_path(magisk_tmp)
             .join_path(PREINITMIRR);
-        for info in parse_mount_info("self") {
+        for info in MountInfoTable::read("self").iter() {
             if info.root == "/" && info.device == preinit_dev {
                 if !info.fs_option.split(',').any(|s| s == "rw") {
                     // Only care about rw mounts
                     continue;
                 }
-                let mut target = info.target;
+                let mut target = info.target.to_string();
                 let target = Utf8CStr::from_string(&mut target);
                 let mut preinit_dir = resolve_preinit_dir(target);
                 let preinit_dir = Utf8CStr::from_string(&mut preinit_dir);
@@ -225,27 +229,29 @@ pub fn find_preinit_device() -> String {
         .to_string()
 }
 
-pub fn revert_unmount(pid: i32) {
-    if pid > 0 {
-        if switch_mnt_ns(pid) != 0 {
-            return;
-        }
-        debug!("denylist: handling PID=[{}]", pid);
-    }
+// The minimal ordered list of Magisk mounts to remove. It is identical for every process
+// forked from the same zygote namespace, so it is only computed once per generation.
+struct UnmountPlan {
+    generation: u32,
+    targets: Vec<Utf8CString>,
+}
+
+static UNMOUNT_PLAN: Mutex<Option<Arc<UnmountPlan>>> = Mutex::new(None);
+static UNMOUNT_PLAN_GENERATION: AtomicU32 = AtomicU32::new(0);
 
+fn build_unmount_plan(generation: u32) -> UnmountPlan {
     let mut targets = Vec::new();
 
+    // The mount namespace may only be switched for the calling thread
+    let mounts = MountInfoTable::read(&format!("self/task/{}", gettid()));
+
     // Unmount Magisk tmpfs and mounts from module files
-    for info in parse_mount_info("self") {
+    for info in mounts.iter() {
         if info.source == "magisk" || info.root.starts_with("/adb/modules") {
             targets.push(info.target);
         }
     }
 
-    if targets.is_empty() {
-        return;
-    }
-
     let mut prev: Option<PathBuf> = None;
     targets.sort();
     targets.retain(|target| {
@@ -254,14 +260,65 @@ pub fn revert_unmount(pid: i32) {
         {
             return false;
         }
-        prev = Some(PathBuf::from(target.clone()));
+        prev = Some(PathBuf::from(target));
         true
     });
 
-    for mut target in targets {
-        let target = Utf8CStr::from_string(&mut target);
+    UnmountPlan {
+        generation,
+        targets: targets.into_iter().map(Utf8CString::from).collect(),
+    }
+}
+
+// Only parses mountinfo of the current namespace if there is no plan for this generation
+fn unmount_plan() -> Arc<UnmountPlan> {
+    let generation = UNMOUNT_PLAN_GENERATION.load(Ordering::Acquire);
+    let mut plan = UNMOUNT_PLAN.lock();
+    match plan.as_ref() {
+        Some(plan) if plan.generation == generation => plan.clone(),
+        _ => {
+            let new_plan = Arc::new(build_unmount_plan(generation));
+            *plan = Some(new_plan.clone());
+            new_plan
+        }
+    }
+}
+
+// Zygisk calls this in zygote, so all children inherit the plan
+pub fn prepare_unmount_plan() {
+    unmount_plan();
+}
+
+// Mounts could have changed, e.g. zygote restarted
+pub fn invalidate_unmount_plan() {
+    UNMOUNT_PLAN_GENERATION.fetch_add(1, Ordering::AcqRel);
+}
+
+pub fn revert_unmount(pid: i32) {
+    if pid > 0 {
+        if switch_mnt_ns(pid) != 0 {
+            return;
+        }
+        debug!("denylist: handling PID=[{}]", pid);
+    }
+
+    let mut stale = false;
+    for target in &unmount_plan().targets {
         if target.unmount().is_ok() {
             debug!("denylist: Unmounted ({})", target);
+        } else {
+            stale = true;
+        }
+    }
+
+    // A target that is not mounted means the plan does not describe this namespace,
+    // rebuild it from what is mounted here.
+    if stale {
+        invalidate_unmount_plan();
+        for target in &unmount_plan().targets {
+            if target.unmount().is_ok() {
+                debug!("denylist: Unmounted ({})", target);
+            }
         }
     }
 }
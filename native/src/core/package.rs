@@ -1,24 +1,40 @@
 use crate::consts::{APP_PACKAGE_NAME, MAGISK_VER_CODE};
 use crate::daemon::{AID_APP_END, AID_APP_START, AID_USER_OFFSET, MagiskD, to_app_id};
-use crate::ffi::{DbEntryKey, get_magisk_tmp, install_apk, uninstall_pkg};
+use crate::db::DbArg::Integer;
+use crate::ffi::{
+    DbEntryKey, PackageChange, get_magisk_tmp, install_apk, scan_deny_apps, uninstall_pkg,
+    update_deny_packages,
+};
 use base::WalkResult::{Abort, Continue, Skip};
 use base::{
-    BufReadExt, Directory, FsPathBuilder, LoggedResult, ReadExt, ResultExt, Utf8CStrBuf,
-    Utf8CString, cstr, error, fd_get_attr, warn,
+    BufReadExt, Directory, FsPathBuilder, LoggedResult, MappedFile, ReadExt, ResultExt, Utf8CStr,
+    Utf8CStrBuf, Utf8CString, cstr, error, fd_get_attr, info, new_daemon_thread, warn,
 };
 use bit_set::BitSet;
+use nix::errno::Errno;
 use nix::fcntl::OFlag;
-use std::collections::BTreeMap;
+use nix::sys::inotify::{AddWatchFlags, InitFlags, Inotify};
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::ffi::OsStr;
 use std::fs::File;
 use std::io;
 use std::io::{Cursor, Read, Seek, SeekFrom};
 use std::os::fd::AsRawFd;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::time::Duration;
 
 const EOCD_MAGIC: u32 = 0x06054B50;
 const APK_SIGNING_BLOCK_MAGIC: [u8; 16] = *b"APK Sig Block 42";
 const SIGNATURE_SCHEME_V2_MAGIC: u32 = 0x7109871A;
 const PACKAGES_XML: &str = "/data/system/packages.xml";
+const PACKAGES_LIST: &Utf8CStr = cstr!("/data/system/packages.list");
+
+// Set once the watcher is in sync with packages.list and applies all changes as deltas
+static WATCHER_ACTIVE: AtomicBool = AtomicBool::new(false);
+static DELTAS_APPLIED: AtomicU64 = AtomicU64::new(0);
+static RESCANS_AVOIDED: AtomicU64 = AtomicU64::new(0);
+static FULL_RESCANS: AtomicU64 = AtomicU64::new(0);
 
 macro_rules! bad_apk {
     ($msg:literal) => {
@@ -172,6 +188,62 @@ fn find_apk_path(pkg: &str) -> LoggedResult<Utf8CString> {
     Ok(buf.to_owned())
 }
 
+#[derive(Default, Clone, Copy, PartialEq)]
+struct FileStamp {
+    ino: u64,
+    size: i64,
+    mtime: i64,
+    mtime_nsec: i64,
+}
+
+impl FileStamp {
+    fn of(path: &Utf8CStr) -> Option<FileStamp> {
+        let st = nix::sys::stat::stat(path).ok()?;
+        Some(FileStamp {
+            ino: st.st_ino as u64,
+            size: st.st_size as i64,
+            mtime: st.st_mtime as i64,
+            mtime_nsec: st.st_mtime_nsec as i64,
+        })
+    }
+}
+
+// Installed packages parsed from packages.list, which is a lot cheaper than
+// checking the data directories of every user.
+#[derive(Default)]
+pub struct PackageIndex {
+    loaded: bool,
+    stamp: FileStamp,
+    // package name -> app_id
+    packages: HashMap<String, i32>,
+}
+
+impl PackageIndex {
+    fn parse(stamp: FileStamp) -> LoggedResult<PackageIndex> {
+        let file = MappedFile::open(PACKAGES_LIST)?;
+        let mut packages = HashMap::new();
+        // Each line starts with "<package name> <uid> "
+        for line in file.as_ref().split(|b| *b == b'\n') {
+            let mut fields = line.split(|b| *b == b' ');
+            let (Some(name), Some(uid)) = (fields.next(), fields.next()) else {
+                continue;
+            };
+            let Ok(name) = str::from_utf8(name) else {
+                continue;
+            };
+            let Some(uid) = str::from_utf8(uid).ok().and_then(|s| s.parse::<i32>().ok()) else {
+                continue;
+            };
+            packages.insert(name.to_string(), to_app_id(uid));
+        }
+        Ok(PackageIndex {
+            loaded: true,
+            stamp,
+            packages,
+        })
+    }
+}
+
 enum Status {
     Installed,
     NotInstalled,
@@ -265,7 +337,10 @@ impl ManagerInfo {
         Status::Installed
     }
 
-    fn check_stub(&mut self, user: i32, pkg: &str) -> Status {
+    fn check_stub(&mut self, daemon: &MagiskD, user: i32, pkg: &str) -> Status {
+        if !daemon.is_package_installed(pkg) {
+            return Status::NotInstalled;
+        }
         let Ok(apk) = find_apk_path(pkg) else {
             return Status::NotInstalled;
         };
@@ -288,7 +363,10 @@ impl ManagerInfo {
         Status::Installed
     }
 
-    fn check_orig(&mut self, user: i32) -> Status {
+    fn check_orig(&mut self, daemon: &MagiskD, user: i32) -> Status {
+        if !daemon.is_package_installed(APP_PACKAGE_NAME) {
+            return Status::NotInstalled;
+        }
         let Ok(apk) = find_apk_path(APP_PACKAGE_NAME) else {
             return Status::NotInstalled;
         };
@@ -382,7 +460,7 @@ impl ManagerInfo {
         }
 
         if !db_pkg.is_empty() {
-            match self.check_stub(user, &db_pkg) {
+            match self.check_stub(daemon, user, &db_pkg) {
                 Status::Installed => {
                     return if matches!(self.check_dyn(daemon, user, &db_pkg), Status::Installed) {
                         (
@@ -406,7 +484,7 @@ impl ManagerInfo {
         self.repackaged_pkg.clear();
         self.repackaged_cert.clear();
 
-        match self.check_orig(user) {
+        match self.check_orig(daemon, user) {
             Status::Installed => {
                 let uid = daemon.get_package_uid(user, APP_PACKAGE_NAME);
                 return if uid < 0 {
@@ -431,6 +509,53 @@ impl ManagerInfo {
 }
 
 impl MagiskD {
+    pub fn package_index(&self) -> Arc<PackageIndex> {
+        let index = self.package_index.load();
+        if index.loaded && WATCHER_ACTIVE.load(Ordering::Acquire) {
+            // The watcher swaps in a new index on every change
+            return index;
+        }
+
+        let stamp = FileStamp::of(PACKAGES_LIST);
+        let is_current = |index: &PackageIndex| index.loaded && Some(index.stamp) == stamp;
+
+        let index = self.package_index.load();
+        if is_current(&index) {
+            return index;
+        }
+
+        let _guard = self.package_index_lock.lock();
+        let index = self.package_index.load();
+        if is_current(&index) {
+            return index;
+        }
+        let Some(stamp) = stamp else {
+            return Arc::new(PackageIndex::default());
+        };
+        match PackageIndex::parse(stamp) {
+            Ok(index) => {
+                let index = Arc::new(index);
+                self.package_index.store(index.clone());
+                index
+            }
+            Err(_) => Arc::new(PackageIndex::default()),
+        }
+    }
+
+    // Returns 0 if the package is not installed, or -1 if packages.list is not available
+    pub fn get_package_app_id(&self, pkg: &str) -> i32 {
+        let index = self.package_index();
+        if !index.loaded {
+            return -1;
+        }
+        index.packages.get(pkg).copied().unwrap_or(0)
+    }
+
+    // Only returns false if we know for sure the package is not installed
+    fn is_package_installed(&self, pkg: &str) -> bool {
+        self.get_package_app_id(pkg) != 0
+    }
+
     fn get_package_uid(&self, user: i32, pkg: &str) -> i32 {
         let path = cstr::buf::default()
             .join_path(self.app_data_dir())
@@ -479,6 +604,17 @@ impl MagiskD {
     // app_no range: [0, 9999]
     pub fn get_app_no_list(&self) -> BitSet {
         let mut list = BitSet::new();
+        let index = self.package_index();
+        if index.loaded {
+            for app_id in index.packages.values() {
+                if (AID_APP_START..=AID_APP_END).contains(app_id) {
+                    list.insert((app_id - AID_APP_START) as usize);
+                }
+            }
+            return list;
+        }
+
+        // Fallback to checking the data directories of all users
         let _ = || -> LoggedResult<()> {
             let mut app_data_dir = Directory::open(self.app_data_dir())?;
             // For each user
@@ -513,3 +649,169 @@ impl MagiskD {
         list
     }
 }
+
+impl MagiskD {
+    fn reload_package_index(&self) -> Option<Arc<PackageIndex>> {
+        let _guard = self.package_index_lock.lock();
+        let stamp = FileStamp::of(PACKAGES_LIST)?;
+        let index = Arc::new(PackageIndex::parse(stamp).ok()?);
+        self.package_index.store(index.clone());
+        Some(index)
+    }
+
+    fn apply_package_delta(&self, old: &PackageIndex, new: &PackageIndex) {
+        let mut changes = Vec::new();
+        for (pkg, app_id) in &old.packages {
+            let new_app_id = new.packages.get(pkg).copied().unwrap_or(0);
+            if new_app_id != *app_id {
+                changes.push(PackageChange {
+                    pkg: pkg.clone(),
+                    old_app_id: *app_id,
+                    new_app_id,
+                });
+            }
+        }
+        for (pkg, app_id) in &new.packages {
+            if !old.packages.contains_key(pkg) {
+                changes.push(PackageChange {
+                    pkg: pkg.clone(),
+                    old_app_id: 0,
+                    new_app_id: *app_id,
+                });
+            }
+        }
+        if changes.is_empty() {
+            return;
+        }
+        DELTAS_APPLIED.fetch_add(changes.len() as u64, Ordering::Relaxed);
+
+        update_deny_packages(&changes);
+
+        // Drop su policies of app IDs that no longer exist
+        let app_ids: HashSet<i32> = new.packages.values().copied().collect();
+        for change in &changes {
+            let app_id = change.old_app_id;
+            if (AID_APP_START..=AID_APP_END).contains(&app_id) && !app_ids.contains(&app_id) {
+                self.db_exec(
+                    "DELETE FROM policies WHERE uid%?=?",
+                    &[Integer(AID_USER_OFFSET as i64), Integer(app_id as i64)],
+                );
+            }
+        }
+
+        // Re-check the manager if it was installed, updated, or removed
+        let manager_pkg = self.get_db_string(DbEntryKey::SuManager);
+        if changes
+            .iter()
+            .any(|c| c.pkg == APP_PACKAGE_NAME || c.pkg == manager_pkg)
+        {
+            self.manager_info.lock().tracked_files.clear();
+        }
+
+        self.invalidate_decision_table();
+    }
+
+    fn full_package_rescan(&self) -> Option<Arc<PackageIndex>> {
+        FULL_RESCANS.fetch_add(1, Ordering::Relaxed);
+        let index = self.reload_package_index();
+        self.prune_su_access();
+        scan_deny_apps();
+        self.manager_info.lock().tracked_files.clear();
+        self.invalidate_decision_table();
+        index
+    }
+
+    fn package_watch_loop(&self) -> LoggedResult<()> {
+        let inotify = Inotify::init(InitFlags::IN_CLOEXEC)?;
+        // packages.list is replaced through rename
+        let list_wd = inotify.add_watch(
+            cstr!("/data/system"),
+            AddWatchFlags::IN_MOVED_TO | AddWatchFlags::IN_CLOSE_WRITE,
+        )?;
+        // Users being added or removed
+        let users_wd = inotify.add_watch(
+            self.app_data_dir(),
+            AddWatchFlags::IN_CREATE | AddWatchFlags::IN_DELETE | AddWatchFlags::IN_ONLYDIR,
+        )?;
+
+        let Some(mut current) = self.full_package_rescan() else {
+            return Ok(());
+        };
+        WATCHER_ACTIVE.store(true, Ordering::Release);
+        info!("pkg: watching {}", PACKAGES_LIST);
+
+        loop {
+            let events = match inotify.read_events() {
+                Err(Errno::EINTR) => continue,
+                result => result?,
+            };
+            let mut list_changed = false;
+            let mut rescan = false;
+            for event in &events {
+                if event.mask.contains(AddWatchFlags::IN_Q_OVERFLOW) || event.wd == users_wd {
+                    rescan = true;
+                } else if event.wd == list_wd
+                    && event.name.as_deref() == Some(OsStr::new("packages.list"))
+                {
+                    list_changed = true;
+                }
+            }
+
+            if rescan {
+                if let Some(index) = self.full_package_rescan() {
+                    current = index;
+                }
+            } else if list_changed && let Some(index) = self.reload_package_index() {
+                self.apply_package_delta(&current, &index);
+                current = index;
+            }
+        }
+    }
+
+    pub fn start_package_watcher(&self) {
+        static STARTED: AtomicBool = AtomicBool::new(false);
+        if STARTED.swap(true, Ordering::AcqRel) {
+            return;
+        }
+
+        extern "C" fn package_watcher_thread(_: usize) -> usize {
+            MagiskD::get().package_watch_loop().log_ok();
+            // Fallback to checking the file on every access
+            WATCHER_ACTIVE.store(false, Ordering::Release);
+            0
+        }
+
+        unsafe {
+            new_daemon_thread(package_watcher_thread, 0);
+        }
+    }
+}
+
+// Package changes are applied as deltas, so full rescans can be skipped
+pub fn package_watcher_active() -> bool {
+    if WATCHER_ACTIVE.load(Ordering::Acquire) {
+        RESCANS_AVOIDED.fetch_add(1, Ordering::Relaxed);
+        true
+    } else {
+        false
+    }
+}
+
+pub fn dump_package_stats(out: &mut Vec<String>) {
+    out.push(format!(
+        "pkg.watcher={}",
+        WATCHER_ACTIVE.load(Ordering::Relaxed) as i32
+    ));
+    out.push(format!(
+        "pkg.deltas_applied={}",
+        DELTAS_APPLIED.load(Ordering::Relaxed)
+    ));
+    out.push(format!(
+        "pkg.rescans_avoided={}",
+        RESCANS_AVOIDED.load(Ordering::Relaxed)
+    ));
+    out.push(format!(
+        "pkg.full_rescans={}",
+        FULL_RESCANS.load(Ordering::Relaxed)
+    ));
+}
@@ -1,6 +1,9 @@
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <consts.hpp>
 #include <base.hpp>
@@ -37,6 +40,65 @@ void exec_script(Utf8CStr script) {
     exec_command_sync(exec, BBEXEC_CMD, script.c_str());
 }
 
+// Scripts of a stage are spawned from a runner process that is forked from the daemon once,
+// with the script environment and busybox path set up in advance. Scripts are started with
+// vfork, the child shares the address space of the runner until execve instead of getting a
+// copy of its page tables. posix_spawn is not available before API 28.
+class script_runner {
+    string bb;
+    int64_t spawn_us = 0;
+    int spawned = 0;
+
+    static int64_t now_us() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+
+public:
+    script_runner() : bb(bbpath()) {
+        set_script_env();
+    }
+
+    int spawn(const char *script) {
+        const char *argv[] = { bb.data(), "sh", script, nullptr };
+        sigset_t mask;
+        sigemptyset(&mask);
+        int64_t begin = now_us();
+        // Written by the child on exec failure, the memory is shared until then
+        volatile int exec_errno = 0;
+        int pid = vfork();
+        if (pid == 0) {
+            // Scripts start with all signals unblocked
+            sigprocmask(SIG_SETMASK, &mask, nullptr);
+            execve(bb.data(), (char **) argv, environ);
+            exec_errno = errno;
+            _exit(127);
+        }
+        if (pid > 0 && exec_errno != 0) {
+            waitpid(pid, nullptr, 0);
+            errno = exec_errno;
+            pid = -1;
+        }
+        if (pid < 0) {
+            PLOGE("exec %s", script);
+            return -1;
+        }
+        int64_t elapsed = now_us() - begin;
+        spawn_us += elapsed;
+        ++spawned;
+        LOGD("spawn [%s] in %lldus\n", script, static_cast<long long>(elapsed));
+        return pid;
+    }
+
+    void report(Utf8CStr stage) const {
+        if (spawned > 0) {
+            LOGD("* %s: spawned %d scripts, avg %lldus\n", stage.c_str(), spawned,
+                 static_cast<long long>(spawn_us / spawned));
+        }
+    }
+};
+
 static timespec pfs_timeout;
 
 #define PFS_SETUP() \
@@ -56,23 +118,31 @@ if (pfs) { \
     } \
 }
 
-#define PFS_WAIT() \
-if (pfs) { \
-    /* If we ran out of time, don't block */ \
-    if (timer_pid < 0) \
-        continue; \
-    if (int pid = waitpid(-1, nullptr, 0); pid == timer_pid) { \
-        LOGW("* post-fs-data scripts blocking phase timeout\n"); \
-        timer_pid = -1; \
-    } \
+// Wait for a post-fs-data script to finish and record it in the boot timeline
+static void pfs_wait(int &timer_pid, int pid, Utf8CStr stage, rust::Str name, int64_t start) {
+    if (pid < 0) {
+        record_boot_script(stage, name, start, ScriptResult::Failed, -1);
+        return;
+    }
+    // If we ran out of time, don't block
+    if (timer_pid < 0) {
+        record_boot_script(stage, name, start, ScriptResult::Detached, -1);
+        return;
+    }
+    int status = -1;
+    if (waitpid(-1, &status, 0) == timer_pid) {
+        LOGW("* post-fs-data scripts blocking phase timeout\n");
+        timer_pid = -1;
+        record_boot_script(stage, name, start, ScriptResult::Timeout, -1);
+        return;
+    }
+    record_boot_script(stage, name, start, ScriptResult::Exited, status);
 }
 
 #define PFS_DONE() \
-if (pfs) { \
-    if (timer_pid > 0) \
-        kill(timer_pid, SIGKILL); \
-    exit(0); \
-}
+if (timer_pid > 0) \
+    kill(timer_pid, SIGKILL); \
+exit(0);
 
 void exec_common_scripts(Utf8CStr stage) {
     LOGI("* Running %s.d scripts\n", stage.c_str());
@@ -89,6 +159,11 @@ void exec_common_scripts(Utf8CStr stage) {
         pfs_timeout.tv_sec += POST_FS_DATA_SCRIPT_MAX_TIME;
     }
     PFS_SETUP()
+    else if (fork_dont_care()) {
+        // Scripts of other stages do not block, run them in the background
+        return;
+    }
+    script_runner runner;
 
     *(name++) = '/';
     int dfd = dirfd(dir.get());
@@ -98,22 +173,217 @@ void exec_common_scripts(Utf8CStr stage) {
                 continue;
             LOGI("%s.d: exec [%s]\n", stage.c_str(), entry->d_name);
             strcpy(name, entry->d_name);
-            exec_t exec {
-                .pre_exec = set_script_env,
-                .fork = pfs ? xfork : fork_dont_care
-            };
-            exec_command(exec, BBEXEC_CMD, path);
-            PFS_WAIT()
+            int64_t start = boot_time_ms();
+            int pid = runner.spawn(path);
+            if (pfs)
+                pfs_wait(timer_pid, pid, stage, entry->d_name, start);
+            else
+                record_boot_script(stage, entry->d_name, start,
+                                   pid < 0 ? ScriptResult::Failed : ScriptResult::Async, -1);
         }
     }
 
+    runner.report(stage);
     PFS_DONE()
 }
 
-static bool operator>(const timespec &a, const timespec &b) {
-    if (a.tv_sec != b.tv_sec)
-        return a.tv_sec > b.tv_sec;
-    return a.tv_nsec > b.tv_nsec;
+#define MODULE_SCRIPT_JOBS     4
+#define MODULE_SCRIPT_MAX_TIME 15
+
+static int64_t monotonic_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Module scripts are scheduled with bounded parallelism in post-fs-data, service scripts
+// are not limited as they run in the background anyway. Modules can declare in module.prop
+// that their scripts have to run before or after the ones of other modules, for example
+// "after=moduleA,moduleB". A script that does not finish within MODULE_SCRIPT_MAX_TIME
+// is left running, but no longer holds back other scripts.
+
+struct script_job {
+    string_view name;
+    string path;
+    // Jobs that cannot start before this one is done
+    vector<size_t> dependents;
+    // Number of unfinished jobs this one has to wait for
+    int waiting = 0;
+    int pid = -1;
+    int64_t start = 0;
+    int64_t deadline = 0;
+    enum { PENDING, RUNNING, DONE } state = PENDING;
+};
+
+static void add_script_order(vector<script_job> &jobs, size_t idx) {
+    char prop[4096];
+    ssprintf(prop, sizeof(prop), MODULEROOT "/%.*s/module.prop",
+             (int) jobs[idx].name.size(), jobs[idx].name.data());
+    auto add_edge = [&](size_t from, size_t to) {
+        if (from == to)
+            return;
+        jobs[from].dependents.push_back(to);
+        ++jobs[to].waiting;
+    };
+    parse_prop_file(prop, [&](Utf8CStr key, Utf8CStr val) -> bool {
+        bool before = key == "before"sv;
+        if (!before && key != "after"sv)
+            return true;
+        for (const auto &id : split(val.c_str(), ", ")) {
+            auto it = std::find_if(jobs.begin(), jobs.end(),
+                                   [&](const script_job &j) { return j.name == id; });
+            if (it == jobs.end())
+                continue;
+            size_t other = it - jobs.begin();
+            before ? add_edge(idx, other) : add_edge(other, idx);
+        }
+        return true;
+    });
+}
+
+// Scripts of modules that depend on each other are run without any ordering among them,
+// modules that merely come after such a cycle still wait for it
+static void break_order_cycles(Utf8CStr stage, vector<script_job> &jobs) {
+    // Find strongly connected components with Tarjan's algorithm
+    size_t n = jobs.size();
+    vector<int> index(n, -1), low(n), comp(n);
+    vector<size_t> stack;
+    vector<bool> on_stack(n);
+    int next_index = 0, next_comp = 0;
+    auto visit = [&](auto &&self, size_t v) -> void {
+        index[v] = low[v] = next_index++;
+        stack.push_back(v);
+        on_stack[v] = true;
+        for (size_t w : jobs[v].dependents) {
+            if (index[w] < 0) {
+                self(self, w);
+                low[v] = std::min(low[v], low[w]);
+            } else if (on_stack[w]) {
+                low[v] = std::min(low[v], index[w]);
+            }
+        }
+        if (low[v] == index[v]) {
+            size_t w;
+            do {
+                w = stack.back();
+                stack.pop_back();
+                on_stack[w] = false;
+                comp[w] = next_comp;
+            } while (w != v);
+            ++next_comp;
+        }
+    };
+    for (size_t v = 0; v < n; ++v) {
+        if (index[v] < 0)
+            visit(visit, v);
+    }
+
+    // Edges within a component form a cycle, edges leaving it are kept
+    for (size_t v = 0; v < n; ++v) {
+        auto in_cycle = [&](size_t w) { return comp[w] == comp[v]; };
+        auto &deps = jobs[v].dependents;
+        for (size_t w : deps) {
+            if (in_cycle(w))
+                --jobs[w].waiting;
+        }
+        if (std::erase_if(deps, in_cycle) > 0) {
+            LOGW("%.*s: %s.sh has circular before/after, ignoring\n",
+                 (int) jobs[v].name.size(), jobs[v].name.data(), stage.c_str());
+        }
+    }
+}
+
+static void run_module_scripts(Utf8CStr stage, vector<script_job> &jobs, int64_t pfs_deadline) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+
+    script_runner runner;
+    int running = 0;
+    auto finish_job = [&](script_job &job, ScriptResult result, int status) {
+        job.state = script_job::DONE;
+        --running;
+        for (size_t idx : job.dependents)
+            --jobs[idx].waiting;
+        if (result == ScriptResult::Timeout) {
+            LOGW("%.*s: %s.sh timeout\n", (int) job.name.size(), job.name.data(), stage.c_str());
+        } else if (result == ScriptResult::Exited) {
+            LOGI("%.*s: %s.sh done in %lldms\n", (int) job.name.size(), job.name.data(),
+                 stage.c_str(), static_cast<long long>(boot_time_ms() - job.start));
+        }
+        record_boot_script(stage, rust::Str(job.name.data(), job.name.size()),
+                           job.start, result, status);
+    };
+    auto start_job = [&](script_job &job) {
+        LOGI("%.*s: exec [%s.sh]\n", (int) job.name.size(), job.name.data(), stage.c_str());
+        job.start = boot_time_ms();
+        job.pid = runner.spawn(job.path.data());
+        job.deadline = monotonic_ms() + MODULE_SCRIPT_MAX_TIME * 1000;
+        job.state = script_job::RUNNING;
+        ++running;
+        if (job.pid < 0)
+            finish_job(job, ScriptResult::Failed, -1);
+    };
+
+    for (;;) {
+        bool pending = false;
+        for (auto &job : jobs) {
+            if (job.state != script_job::PENDING)
+                continue;
+            if (job.waiting <= 0 && (pfs_deadline == 0 || running < MODULE_SCRIPT_JOBS))
+                start_job(job);
+            else
+                pending = true;
+        }
+        if (running == 0 && !pending)
+            break;
+
+        // Wait for any script to exit or the next deadline
+        int64_t now = monotonic_ms();
+        int64_t deadline = pfs_deadline > 0 ? pfs_deadline : INT64_MAX;
+        for (const auto &job : jobs) {
+            if (job.state == script_job::RUNNING)
+                deadline = std::min(deadline, job.deadline);
+        }
+        int64_t wait = std::max(deadline - now, static_cast<int64_t>(0));
+        timespec ts{ .tv_sec = wait / 1000, .tv_nsec = (wait % 1000) * 1000000 };
+        sigtimedwait(&mask, nullptr, &ts);
+
+        int status;
+        for (int pid; (pid = waitpid(-1, &status, WNOHANG)) > 0;) {
+            for (auto &job : jobs) {
+                if (job.state == script_job::RUNNING && job.pid == pid) {
+                    finish_job(job, ScriptResult::Exited, status);
+                    break;
+                }
+            }
+        }
+
+        // Service scripts may keep running in the background, they just stop holding back others
+        now = monotonic_ms();
+        auto expired = pfs_deadline > 0 ? ScriptResult::Timeout : ScriptResult::Detached;
+        for (auto &job : jobs) {
+            if (job.state == script_job::RUNNING && now >= job.deadline)
+                finish_job(job, expired, -1);
+        }
+
+        if (pfs_deadline > 0 && now >= pfs_deadline) {
+            LOGW("* post-fs-data scripts blocking phase timeout\n");
+            // Launch whatever is left without blocking the boot any further
+            for (auto &job : jobs) {
+                if (job.state == script_job::PENDING) {
+                    start_job(job);
+                    if (job.state == script_job::RUNNING)
+                        finish_job(job, ScriptResult::Detached, -1);
+                } else if (job.state == script_job::RUNNING) {
+                    finish_job(job, ScriptResult::Timeout, -1);
+                }
+            }
+            break;
+        }
+    }
+    runner.report(stage);
 }
 
 void exec_module_scripts(Utf8CStr stage, const rust::Vec<ModuleInfo> &module_list) {
@@ -121,32 +391,42 @@ void exec_module_scripts(Utf8CStr stage, const rust::Vec<ModuleInfo> &module_lis
     if (module_list.empty())
         return;
 
-    bool pfs = stage == "post-fs-data";
-    if (pfs) {
-        timespec now{};
-        clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t pfs_deadline = 0;
+    if (stage == "post-fs-data"sv) {
+        pfs_deadline = pfs_timeout.tv_sec * 1000LL + pfs_timeout.tv_nsec / 1000000;
         // If we had already timed out, treat it as service mode
-        if (now > pfs_timeout)
-            pfs = false;
+        if (monotonic_ms() > pfs_deadline)
+            pfs_deadline = 0;
     }
-    int timer_pid = -1;
-    PFS_SETUP()
 
+    vector<script_job> jobs;
     char path[4096];
     for (auto &m : module_list) {
-        sprintf(path, MODULEROOT "/%.*s/%s.sh", (int) m.name.size(), m.name.data(), stage.c_str());
+        ssprintf(path, sizeof(path), MODULEROOT "/%.*s/%s.sh",
+                 (int) m.name.size(), m.name.data(), stage.c_str());
         if (access(path, F_OK) == -1)
             continue;
-        LOGI("%.*s: exec [%s.sh]\n", (int) m.name.size(), m.name.data(), stage.c_str());
-        exec_t exec {
-            .pre_exec = set_script_env,
-            .fork = pfs ? xfork : fork_dont_care
-        };
-        exec_command(exec, BBEXEC_CMD, path);
-        PFS_WAIT()
+        jobs.push_back({ .name = string_view(m.name.data(), m.name.size()), .path = path });
     }
+    if (jobs.empty())
+        return;
+    for (size_t i = 0; i < jobs.size(); ++i)
+        add_script_order(jobs, i);
+    break_order_cycles(stage, jobs);
 
-    PFS_DONE()
+    // post-fs-data blocks until all scripts are done or timed out,
+    // the scheduler of other stages runs in the background.
+    if (pfs_deadline > 0) {
+        if (int pid = xfork()) {
+            if (pid > 0)
+                waitpid(pid, nullptr, 0);
+            return;
+        }
+    } else if (fork_dont_care()) {
+        return;
+    }
+    run_module_scripts(stage, jobs, pfs_deadline);
+    exit(0);
 }
 
 constexpr char install_script[] = R"EOF(
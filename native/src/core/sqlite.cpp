@@ -23,6 +23,8 @@ static const char *(*sqlite3_column_name)(sqlite3_stmt*, int N);
 static const char *(*sqlite3_column_text)(sqlite3_stmt*, int iCol);
 static int (*sqlite3_column_int)(sqlite3_stmt*, int iCol);
 static int (*sqlite3_step)(sqlite3_stmt*);
+static int (*sqlite3_reset)(sqlite3_stmt *pStmt);
+static int (*sqlite3_clear_bindings)(sqlite3_stmt*);
 static int (*sqlite3_finalize)(sqlite3_stmt *pStmt);
 
 // Internal Android linker APIs
@@ -83,6 +85,8 @@ static bool load_sqlite() {
     DLOAD(sqlite, sqlite3_bind_int64);
     DLOAD(sqlite, sqlite3_bind_text);
     DLOAD(sqlite, sqlite3_step);
+    DLOAD(sqlite, sqlite3_reset);
+    DLOAD(sqlite, sqlite3_clear_bindings);
     DLOAD(sqlite, sqlite3_column_count);
     DLOAD(sqlite, sqlite3_column_name);
     DLOAD(sqlite, sqlite3_column_text);
@@ -99,6 +103,42 @@ using sql_exec_callback_real = void(*)(void*, StringSlice, sqlite3_stmt*);
 
 #define sql_chk(fn, ...) if (int rc = fn(__VA_ARGS__); rc != SQLITE_OK) return rc
 
+static int sql_exec_stmt_impl(
+        sqlite3_stmt *stmt,
+        sql_bind_callback bind_cb, void *bind_cookie,
+        sql_exec_callback exec_cb, void *exec_cookie) {
+    // Step 1: bind arguments
+    if (bind_cb) {
+        if (int count = sqlite3_bind_parameter_count(stmt)) {
+            auto real_cb = reinterpret_cast<sql_bind_callback_real>(bind_cb);
+            for (int i = 1; i <= count; ++i) {
+                sql_chk(real_cb, bind_cookie, i, stmt);
+            }
+        }
+    }
+
+    // Step 2: execute
+    bool first = true;
+    StringVec columns;
+    for (;;) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) return rc;
+        if (exec_cb == nullptr) continue;
+        if (first) {
+            int count = sqlite3_column_count(stmt);
+            for (int i = 0; i < count; ++i) {
+                columns.emplace_back(sqlite3_column_name(stmt, i));
+            }
+            first = false;
+        }
+        auto real_cb = reinterpret_cast<sql_exec_callback_real>(exec_cb);
+        real_cb(exec_cookie, StringSlice(columns), stmt);
+    }
+
+    return SQLITE_OK;
+}
+
 // Exports to Rust
 extern "C" int sql_exec_impl(
         sqlite3 *db, rust::Str zSql,
@@ -108,7 +148,7 @@ extern "C" int sql_exec_impl(
     unique_ptr<sqlite3_stmt, decltype(sqlite3_finalize)> stmt(nullptr, sqlite3_finalize);
 
     while (sql != zSql.end()) {
-        // Step 1: prepare statement
+        // Prepare statement
         {
             sqlite3_stmt *st = nullptr;
             sql_chk(sqlite3_prepare_v2, db, sql, zSql.end() - sql, &st, &sql);
@@ -116,39 +156,41 @@ extern "C" int sql_exec_impl(
             stmt.reset(st);
         }
 
-        // Step 2: bind arguments
-        if (bind_cb) {
-            if (int count = sqlite3_bind_parameter_count(stmt.get())) {
-                auto real_cb = reinterpret_cast<sql_bind_callback_real>(bind_cb);
-                for (int i = 1; i <= count; ++i) {
-                    sql_chk(real_cb, bind_cookie, i, stmt.get());
-                }
-            }
-        }
-
-        // Step 3: execute
-        bool first = true;
-        StringVec columns;
-        for (;;) {
-            int rc = sqlite3_step(stmt.get());
-            if (rc == SQLITE_DONE) break;
-            if (rc != SQLITE_ROW) return rc;
-            if (exec_cb == nullptr) continue;
-            if (first) {
-                int count = sqlite3_column_count(stmt.get());
-                for (int i = 0; i < count; ++i) {
-                    columns.emplace_back(sqlite3_column_name(stmt.get(), i));
-                }
-                first = false;
-            }
-            auto real_cb = reinterpret_cast<sql_exec_callback_real>(exec_cb);
-            real_cb(exec_cookie, StringSlice(columns), stmt.get());
-        }
+        // Bind and execute
+        sql_chk(sql_exec_stmt_impl, stmt.get(), bind_cb, bind_cookie, exec_cb, exec_cookie);
     }
 
     return SQLITE_OK;
 }
 
+// Prepare a statement that can be reused across multiple executions.
+// If zSql contains more than a single statement, *stmt is set to nullptr.
+extern "C" int sql_prepare_impl(sqlite3 *db, rust::Str zSql, sqlite3_stmt **stmt) {
+    const char *tail = nullptr;
+    *stmt = nullptr;
+    sql_chk(sqlite3_prepare_v2, db, zSql.data(), zSql.size(), stmt, &tail);
+    if (*stmt && tail != zSql.end()) {
+        sqlite3_finalize(*stmt);
+        *stmt = nullptr;
+    }
+    return SQLITE_OK;
+}
+
+extern "C" void sql_finalize_impl(sqlite3_stmt *stmt) {
+    sqlite3_finalize(stmt);
+}
+
+extern "C" int sql_exec_prepared(
+        sqlite3_stmt *stmt,
+        sql_bind_callback bind_cb, void *bind_cookie,
+        sql_exec_callback exec_cb, void *exec_cookie) {
+    int rc = sql_exec_stmt_impl(stmt, bind_cb, bind_cookie, exec_cb, exec_cookie);
+    // Always make the statement ready for the next execution
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
 int DbValues::get_int(int index) const {
     return sqlite3_column_int((sqlite3_stmt*) this, index);
 }
@@ -301,6 +343,33 @@ sqlite3 *open_and_init_db() {
         sql_chk_log(sql_exec_impl, db.get(), "PRAGMA user_version=" DB_VERSION_STR);
     }
 
+    // With WAL, readers and the writer no longer block each other. In WAL mode,
+    // synchronous=NORMAL is still corruption safe, and only skips fsync on each commit.
+    if (int rc = sql_exec_impl(db.get(),
+            "PRAGMA journal_mode=WAL;"
+            "PRAGMA synchronous=NORMAL;"
+            "PRAGMA busy_timeout=1000;"); rc != SQLITE_OK) {
+        LOGW("sqlite3: cannot enable WAL: %s\n", sqlite3_errstr(rc));
+    }
+
+    return db.release();
+}
+
+sqlite3 *open_db_readonly() {
+    if (!load_sqlite()) {
+        LOGE("sqlite3: Cannot load libsqlite.so\n");
+        return nullptr;
+    }
+
+    unique_ptr<sqlite3, decltype(sqlite3_close)> db(nullptr, sqlite3_close);
+    {
+        sqlite3 *sql;
+        sql_chk_log(sqlite3_open_v2, MAGISKDB, &sql,
+                    SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+        db.reset(sql);
+    }
+    sql_chk_log(sql_exec_impl, db.get(), "PRAGMA busy_timeout=1000");
+
     return db.release();
 }
 
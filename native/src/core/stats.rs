@@ -0,0 +1,302 @@
+use crate::ffi::RequestCode;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+// Log-linear buckets: every power of 2 is split into 8 linear sub-buckets,
+// which bounds the relative error of any recorded value to 12.5%.
+const SUB_BUCKET_BITS: u32 = 3;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+// Values are in microseconds, anything larger than 2^36us (~19 hours) is clamped.
+const MAX_MSB: u32 = 35;
+const NUM_BUCKETS: usize = (MAX_MSB as usize - 1) * SUB_BUCKETS;
+
+pub struct Histogram {
+    buckets: [AtomicU64; NUM_BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+fn bucket_index(v: u64) -> usize {
+    if v < SUB_BUCKETS as u64 {
+        return v as usize;
+    }
+    let msb = (63 - v.leading_zeros()).min(MAX_MSB);
+    let shift = msb - SUB_BUCKET_BITS;
+    let sub = ((v >> shift) as usize) & (SUB_BUCKETS - 1);
+    ((msb - SUB_BUCKET_BITS + 1) as usize) * SUB_BUCKETS + sub
+}
+
+// The largest value that falls into the bucket
+fn bucket_upper_bound(idx: usize) -> u64 {
+    if idx < SUB_BUCKETS {
+        return idx as u64;
+    }
+    let shift = (idx / SUB_BUCKETS - 1) as u32;
+    let sub = (idx % SUB_BUCKETS) as u64;
+    ((SUB_BUCKETS as u64 + sub + 1) << shift) - 1
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        Histogram {
+            buckets: [const { AtomicU64::new(0) }; NUM_BUCKETS],
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, d: Duration) {
+        let v = d.as_micros() as u64;
+        self.buckets[bucket_index(v)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(v, Ordering::Relaxed);
+        self.max.fetch_max(v, Ordering::Relaxed);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    pub fn avg(&self) -> u64 {
+        let count = self.count();
+        if count == 0 {
+            0
+        } else {
+            self.sum.load(Ordering::Relaxed) / count
+        }
+    }
+
+    // Returns the value in microseconds at the given percentile
+    pub fn percentile(&self, p: u64) -> u64 {
+        let count = self.count();
+        if count == 0 {
+            return 0;
+        }
+        let target = (count * p).div_ceil(100).max(1);
+        let mut seen = 0;
+        for (i, bucket) in self.buckets.iter().enumerate() {
+            seen += bucket.load(Ordering::Relaxed);
+            if seen >= target {
+                return bucket_upper_bound(i).min(self.max.load(Ordering::Relaxed));
+            }
+        }
+        self.max.load(Ordering::Relaxed)
+    }
+
+    pub fn dump(&self, name: &str, out: &mut Vec<String>) {
+        let count = self.count();
+        if count == 0 {
+            return;
+        }
+        out.push(format!(
+            "{name}: count={count} avg_us={} p50_us={} p90_us={} p99_us={} max_us={}",
+            self.avg(),
+            self.percentile(50),
+            self.percentile(90),
+            self.percentile(99),
+            self.max.load(Ordering::Relaxed)
+        ));
+    }
+}
+
+static REQUEST_LATENCY: [Histogram; RequestCode::END.repr as usize] =
+    [const { Histogram::new() }; RequestCode::END.repr as usize];
+
+fn request_name(code: RequestCode) -> &'static str {
+    match code {
+        RequestCode::START_DAEMON => "start_daemon",
+        RequestCode::CHECK_VERSION => "check_version",
+        RequestCode::CHECK_VERSION_CODE => "check_version_code",
+        RequestCode::STOP_DAEMON => "stop_daemon",
+        RequestCode::SUPERUSER => "superuser",
+        RequestCode::ZYGOTE_RESTART => "zygote_restart",
+        RequestCode::DENYLIST => "denylist",
+        RequestCode::SQLITE_CMD => "sqlite_cmd",
+        RequestCode::REMOVE_MODULES => "remove_modules",
+        RequestCode::ZYGISK => "zygisk",
+        RequestCode::GET_STATS => "get_stats",
+        RequestCode::IMPORT_POLICIES => "import_policies",
+        RequestCode::EXPORT_POLICIES => "export_policies",
+        RequestCode::POST_FS_DATA => "post_fs_data",
+        RequestCode::LATE_START => "late_start",
+        RequestCode::BOOT_COMPLETE => "boot_complete",
+        _ => "unknown",
+    }
+}
+
+// Latency from accepting the connection to dispatching the request to its handler
+pub fn record_request_latency(code: RequestCode, d: Duration) {
+    if let Some(hist) = REQUEST_LATENCY.get(code.repr as usize) {
+        hist.record(d);
+        trace::record(request_name(code), d);
+    }
+}
+
+pub fn dump_request_latency(out: &mut Vec<String>) {
+    for (i, hist) in REQUEST_LATENCY.iter().enumerate() {
+        let code = RequestCode { repr: i as i32 };
+        hist.dump(&format!("request.{}", request_name(code)), out);
+    }
+    UNMOUNT_LATENCY.dump("denylist.unmount", out);
+    trace::dump_stages(out);
+}
+
+static UNMOUNT_LATENCY: Histogram = Histogram::new();
+
+// Latency from a denylist target being detected to its mounts being reverted
+pub fn record_unmount_latency(us: u64) {
+    let d = Duration::from_micros(us);
+    UNMOUNT_LATENCY.record(d);
+    trace::record("denylist.unmount", d);
+}
+
+pub use trace::{Span, span};
+
+// Stages inside requests and boot steps. Spans over them are only timed with the trace
+// feature, without it span() returns an empty guard and compiles away.
+#[derive(Copy, Clone)]
+pub enum Stage {
+    SuPolicy,
+    ZygiskGetInfo,
+    ModuleMount,
+    CommonScripts,
+    ModuleScripts,
+}
+
+#[cfg_attr(not(feature = "trace"), allow(dead_code))]
+impl Stage {
+    const ALL: [Stage; 5] = [
+        Stage::SuPolicy,
+        Stage::ZygiskGetInfo,
+        Stage::ModuleMount,
+        Stage::CommonScripts,
+        Stage::ModuleScripts,
+    ];
+
+    fn name(self) -> &'static str {
+        match self {
+            Stage::SuPolicy => "su_policy",
+            Stage::ZygiskGetInfo => "zygisk_get_info",
+            Stage::ModuleMount => "module_mount",
+            Stage::CommonScripts => "common_scripts",
+            Stage::ModuleScripts => "module_scripts",
+        }
+    }
+}
+
+// Stage histograms and individual events are only kept with the trace feature.
+// Events can be exported in the Chrome trace format with `magisk --stats --trace`.
+#[cfg(feature = "trace")]
+pub mod trace {
+    use super::{Histogram, Stage};
+    use base::libc;
+    use nix::unistd::gettid;
+    use std::collections::VecDeque;
+    use std::sync::nonpoison::Mutex;
+    use std::time::{Duration, Instant};
+
+    static STAGE_LATENCY: [Histogram; Stage::ALL.len()] =
+        [const { Histogram::new() }; Stage::ALL.len()];
+
+    // Records the time until it is dropped into the histogram of the stage
+    pub struct Span {
+        stage: Stage,
+        start: Instant,
+    }
+
+    pub fn span(stage: Stage) -> Span {
+        Span {
+            stage,
+            start: Instant::now(),
+        }
+    }
+
+    impl Drop for Span {
+        fn drop(&mut self) {
+            let d = self.start.elapsed();
+            STAGE_LATENCY[self.stage as usize].record(d);
+            record(self.stage.name(), d);
+        }
+    }
+
+    pub fn dump_stages(out: &mut Vec<String>) {
+        for (i, hist) in STAGE_LATENCY.iter().enumerate() {
+            hist.dump(&format!("stage.{}", Stage::ALL[i].name()), out);
+        }
+    }
+
+    const MAX_EVENTS: usize = 4096;
+
+    struct Event {
+        name: &'static str,
+        tid: i32,
+        // CLOCK_MONOTONIC in microseconds
+        start_us: u64,
+        duration_us: u64,
+    }
+
+    static EVENTS: Mutex<VecDeque<Event>> = Mutex::new(VecDeque::new());
+
+    fn monotonic_us() -> u64 {
+        let mut ts = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+        ts.tv_sec as u64 * 1_000_000 + ts.tv_nsec as u64 / 1000
+    }
+
+    // Events are recorded when they end
+    pub fn record(name: &'static str, duration: Duration) {
+        let duration_us = duration.as_micros() as u64;
+        let event = Event {
+            name,
+            tid: gettid().as_raw(),
+            start_us: monotonic_us().saturating_sub(duration_us),
+            duration_us,
+        };
+        let mut events = EVENTS.lock();
+        if events.len() >= MAX_EVENTS {
+            events.pop_front();
+        }
+        events.push_back(event);
+    }
+
+    pub fn dump(out: &mut Vec<String>) {
+        let pid = std::process::id();
+        let events = EVENTS.lock();
+        out.push("[".to_string());
+        for (i, e) in events.iter().enumerate() {
+            let sep = if i + 1 < events.len() { "," } else { "" };
+            out.push(format!(
+                r#"{{"name":"{}","ph":"X","ts":{},"dur":{},"pid":{pid},"tid":{}}}{sep}"#,
+                e.name, e.start_us, e.duration_us, e.tid
+            ));
+        }
+        out.push("]".to_string());
+    }
+}
+
+#[cfg(not(feature = "trace"))]
+pub mod trace {
+    use super::Stage;
+    use std::time::Duration;
+
+    pub struct Span;
+
+    #[inline(always)]
+    pub fn span(_: Stage) -> Span {
+        Span
+    }
+
+    #[inline(always)]
+    pub fn record(_: &'static str, _: Duration) {}
+
+    pub fn dump_stages(_: &mut Vec<String>) {}
+
+    pub fn dump(out: &mut Vec<String>) {
+        out.push("[]".to_string());
+    }
+}
@@ -4,6 +4,7 @@ use crate::daemon::{AID_ROOT, AID_SHELL, MagiskD, to_app_id, to_user_id};
 use crate::db::{DbSettings, MultiuserMode, RootAccess};
 use crate::ffi::{SuPolicy, SuRequest, exec_root_shell};
 use crate::socket::IpcRead;
+use crate::stats::{Stage, span};
 use base::{LoggedResult, ResultExt, WriteExt, debug, error, exit_on_error, libc, warn};
 use std::os::fd::IntoRawFd;
 use std::os::unix::net::{UCred, UnixStream};
@@ -199,6 +200,7 @@ impl MagiskD {
     }
 
     fn get_su_info(&self, uid: i32) -> Arc<SuInfo> {
+        let _span = span(Stage::SuPolicy);
         if uid == AID_ROOT {
             return Arc::new(SuInfo::allow(AID_ROOT));
         }
@@ -1,10 +1,13 @@
-use crate::daemon::{
-    AID_APP_END, AID_APP_START, AID_ROOT, AID_SHELL, MagiskD, to_app_id, to_user_id,
-};
+use crate::daemon::{AID_APP_END, AID_APP_START, MagiskD, to_app_id};
 use crate::db::DbArg::Integer;
-use crate::db::{MultiuserMode, RootAccess, SqlTable, SqliteResult, SqliteReturn};
+use crate::db::{SqlTable, SqliteResult, SqliteReturn};
 use crate::ffi::{DbValues, SuPolicy};
-use base::ResultExt;
+use crate::socket::{IpcRead, IpcWrite};
+use base::derive::Decodable;
+use base::{LoggedResult, ResultExt, WriteExt, log_err};
+use std::fmt;
+use std::io::{BufReader, BufWriter, Write};
+use std::os::unix::net::UnixStream;
 
 impl Default for SuPolicy {
     fn default() -> Self {
@@ -33,6 +36,64 @@ impl SqlTable for RootSettings {
     }
 }
 
+// A row in the policies table, used for bulk import and export
+#[derive(Decodable)]
+pub struct SuPolicyRow {
+    pub uid: i32,
+    pub policy: i32,
+    pub until: i32,
+    pub logging: bool,
+    pub notification: bool,
+}
+
+impl SuPolicyRow {
+    // Text format: "uid policy until logging notification"
+    pub fn parse(line: &str) -> Option<SuPolicyRow> {
+        let mut it = line.split_whitespace().map(str::parse::<i32>);
+        let row = SuPolicyRow {
+            uid: it.next()?.ok()?,
+            policy: it.next()?.ok()?,
+            until: it.next()?.ok()?,
+            logging: it.next()?.ok()? != 0,
+            notification: it.next()?.ok()? != 0,
+        };
+        if it.next().is_some() || !row.is_valid() {
+            return None;
+        }
+        Some(row)
+    }
+
+    fn is_valid(&self) -> bool {
+        self.uid >= 0
+            && (SuPolicy::Query.repr..=SuPolicy::Restrict.repr).contains(&self.policy)
+            && self.until >= 0
+    }
+}
+
+impl fmt::Display for SuPolicyRow {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{} {} {} {} {}",
+            self.uid, self.policy, self.until, self.logging as i32, self.notification as i32
+        )
+    }
+}
+
+struct PolicyList(Vec<SuPolicyRow>);
+
+impl SqlTable for PolicyList {
+    fn on_row(&mut self, _: &[String], values: &DbValues) {
+        self.0.push(SuPolicyRow {
+            uid: values.get_int(0),
+            policy: values.get_int(1),
+            until: values.get_int(2),
+            logging: values.get_int(3) != 0,
+            notification: values.get_int(4) != 0,
+        });
+    }
+}
+
 struct UidList(Vec<i32>);
 
 impl SqlTable for UidList {
@@ -43,7 +104,7 @@ impl SqlTable for UidList {
 
 impl MagiskD {
     pub fn get_root_settings(&self, uid: i32, settings: &mut RootSettings) -> SqliteResult<()> {
-        self.db_exec_with_rows(
+        self.db_query_with_rows(
             "SELECT policy, logging, notification FROM policies \
              WHERE uid=? AND (until=0 OR until>strftime('%s', 'now'))",
             &[Integer(uid as i64)],
@@ -55,7 +116,7 @@ impl MagiskD {
     pub fn prune_su_access(&self) {
         let mut list = UidList(Vec::new());
         if self
-            .db_exec_with_rows("SELECT uid FROM policies", &[], &mut list)
+            .db_query_with_rows("SELECT uid FROM policies", &[], &mut list)
             .sql_result()
             .log()
             .is_err()
@@ -80,42 +141,56 @@ impl MagiskD {
         for uid in rm_uids {
             self.db_exec("DELETE FROM policies WHERE uid=?", &[Integer(uid as i64)]);
         }
+        self.invalidate_decision_table();
     }
 
-    pub fn uid_granted_root(&self, mut uid: i32) -> bool {
-        if uid == AID_ROOT {
-            return true;
-        }
-
-        let cfg = match self.get_db_settings().log() {
-            Ok(cfg) => cfg,
-            Err(_) => return false,
-        };
-
-        // Check user root access settings
-        match cfg.root_access {
-            RootAccess::Disabled => return false,
-            RootAccess::AppsOnly if uid == AID_SHELL => return false,
-            RootAccess::AdbOnly if uid != AID_SHELL => return false,
-            _ => {}
-        }
+    // Apply all policies in a single transaction and reply with the number of rows written
+    pub fn import_su_policies(&self, mut client: UnixStream) -> LoggedResult<()> {
+        let rows: Vec<SuPolicyRow> = BufReader::new(&mut client).read_decodable()?;
+        let result = || -> LoggedResult<i32> {
+            if !rows.iter().all(SuPolicyRow::is_valid) {
+                return log_err!("su: invalid policy in import batch");
+            }
+            self.db_transaction(|tx| {
+                for row in &rows {
+                    tx.exec(
+                        "INSERT OR REPLACE INTO policies \
+                         (uid,policy,until,logging,notification) VALUES(?,?,?,?,?)",
+                        &[
+                            Integer(row.uid as i64),
+                            Integer(row.policy as i64),
+                            Integer(row.until as i64),
+                            Integer(row.logging as i64),
+                            Integer(row.notification as i64),
+                        ],
+                    )?;
+                }
+                Ok(())
+            })?;
+            self.invalidate_decision_table();
+            Ok(rows.len() as i32)
+        }();
+        client.write_pod(&result.unwrap_or(-1))?;
+        Ok(())
+    }
 
-        // Check multiuser settings
-        match cfg.multiuser_mode {
-            MultiuserMode::OwnerOnly if to_user_id(uid) != 0 => return false,
-            MultiuserMode::OwnerManaged => uid = to_app_id(uid),
-            _ => {}
+    // Every row is preceded by `true`, the stream is terminated with `false`.
+    // Rows are collected first so a slow client never holds the database connection.
+    pub fn export_su_policies(&self, mut client: UnixStream) -> LoggedResult<()> {
+        let mut list = PolicyList(Vec::new());
+        self.db_query_with_rows(
+            "SELECT uid, policy, until, logging, notification FROM policies",
+            &[],
+            &mut list,
+        )
+        .sql_result()?;
+        let mut writer = BufWriter::new(&mut client);
+        for row in &list.0 {
+            writer.write_encodable(&true)?;
+            writer.write_encodable(row)?;
         }
-
-        let mut granted = false;
-        let mut output_fn =
-            |_: &[String], values: &DbValues| granted = values.get_int(0) == SuPolicy::Allow.repr;
-        self.db_exec_with_rows(
-            "SELECT policy FROM policies WHERE uid=? AND (until=0 OR until>strftime('%s', 'now'))",
-            &[Integer(uid as i64)],
-            &mut output_fn,
-        );
-
-        granted
+        writer.write_encodable(&false)?;
+        writer.flush()?;
+        Ok(())
     }
 }
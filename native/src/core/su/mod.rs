@@ -4,4 +4,5 @@ mod db;
 mod pts;
 
 pub use daemon::SuInfo;
+pub use db::SuPolicyRow;
 pub use pts::{get_pty_num, pump_tty};
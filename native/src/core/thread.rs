@@ -1,62 +1,183 @@
-use base::{ResultExt, new_daemon_thread};
+use base::{ResultExt, ThreadEntry};
 use nix::sys::signal::SigSet;
 use nix::unistd::{getpid, gettid};
-use std::sync::LazyLock;
+use std::collections::VecDeque;
 use std::sync::nonpoison::{Condvar, Mutex};
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
-static THREAD_POOL: LazyLock<ThreadPool> = LazyLock::new(ThreadPool::default);
+static THREAD_POOL: ThreadPool = ThreadPool::new(CORE_POOL_SIZE, MAX_POOL_SIZE, QUEUE_CAPACITY);
 
 const THREAD_IDLE_MAX_SEC: u64 = 60;
 const CORE_POOL_SIZE: i32 = 3;
+// Short requests are bounded by these limits. Tasks such as su sessions can occupy
+// a thread for a very long time, those are submitted with submit_long and always
+// get a thread so they can never starve short requests.
+const MAX_POOL_SIZE: i32 = 128;
+const QUEUE_CAPACITY: usize = 64;
+
+type Task = Box<dyn FnOnce() + Send>;
+
+struct QueuedTask {
+    task: Task,
+    queued_at: Instant,
+}
 
-#[derive(Default)]
 pub struct ThreadPool {
-    task_is_some: Condvar,
-    task_is_none: Condvar,
+    core_size: i32,
+    max_size: i32,
+    capacity: usize,
+    has_task: Condvar,
     info: Mutex<PoolInfo>,
 }
 
-#[derive(Default)]
 struct PoolInfo {
     idle_threads: i32,
     total_threads: i32,
-    task: Option<Box<dyn FnOnce() + Send>>,
+    peak_threads: i32,
+    queue: VecDeque<QueuedTask>,
+    peak_queue: usize,
+    completed: u64,
+    rejected: u64,
+    wait_time: Duration,
+    max_wait_time: Duration,
+    busy_time: Duration,
+    idle_time: Duration,
+}
+
+impl PoolInfo {
+    const fn new() -> Self {
+        PoolInfo {
+            idle_threads: 0,
+            total_threads: 0,
+            peak_threads: 0,
+            queue: VecDeque::new(),
+            peak_queue: 0,
+            completed: 0,
+            rejected: 0,
+            wait_time: Duration::ZERO,
+            max_wait_time: Duration::ZERO,
+            busy_time: Duration::ZERO,
+            idle_time: Duration::ZERO,
+        }
+    }
+}
+
+pub struct PoolStats {
+    pub total_threads: i32,
+    pub idle_threads: i32,
+    pub peak_threads: i32,
+    pub queue_depth: usize,
+    pub peak_queue: usize,
+    pub completed: u64,
+    pub rejected: u64,
+    pub wait_time: Duration,
+    pub max_wait_time: Duration,
+    pub busy_time: Duration,
+    pub idle_time: Duration,
+}
+
+impl PoolStats {
+    // Percentage of worker time spent running tasks
+    pub fn utilization(&self) -> u64 {
+        let total = (self.busy_time + self.idle_time).as_micros();
+        if total == 0 {
+            0
+        } else {
+            (self.busy_time.as_micros() * 100 / total) as u64
+        }
+    }
+
+    pub fn avg_wait_time(&self) -> Duration {
+        if self.completed == 0 {
+            Duration::ZERO
+        } else {
+            self.wait_time / self.completed as u32
+        }
+    }
+
+    pub fn dump(&self, name: &str, out: &mut Vec<String>) {
+        out.push(format!("{name}.threads={}", self.total_threads));
+        out.push(format!("{name}.threads_idle={}", self.idle_threads));
+        out.push(format!("{name}.threads_peak={}", self.peak_threads));
+        out.push(format!("{name}.queue_depth={}", self.queue_depth));
+        out.push(format!("{name}.queue_peak={}", self.peak_queue));
+        out.push(format!("{name}.tasks_completed={}", self.completed));
+        out.push(format!("{name}.tasks_rejected={}", self.rejected));
+        out.push(format!(
+            "{name}.wait_avg_us={}",
+            self.avg_wait_time().as_micros()
+        ));
+        out.push(format!(
+            "{name}.wait_max_us={}",
+            self.max_wait_time.as_micros()
+        ));
+        out.push(format!("{name}.utilization={}%", self.utilization()));
+    }
 }
 
 impl ThreadPool {
-    fn pool_loop(&self, is_core_pool: bool) {
+    pub const fn new(core_size: i32, max_size: i32, capacity: usize) -> Self {
+        ThreadPool {
+            core_size,
+            max_size,
+            capacity,
+            has_task: Condvar::new(),
+            info: Mutex::new(PoolInfo::new()),
+        }
+    }
+
+    fn pool_loop(&self, is_core_pool: bool, mut first_task: Option<Task>) {
         let mask = SigSet::all();
+        let mut last_busy = Duration::ZERO;
 
         loop {
             // Always restore the sigmask to block all signals
             mask.thread_set_mask().log_ok();
 
-            let task: Option<Box<dyn FnOnce() + Send>>;
-            {
+            let task: Task;
+            if let Some(first) = first_task.take() {
+                task = first;
+            } else {
                 let mut info = self.info.lock();
+                if !last_busy.is_zero() {
+                    info.busy_time += last_busy;
+                    info.completed += 1;
+                }
                 info.idle_threads += 1;
-                if info.task.is_none() {
+                let idle_start = Instant::now();
+                let next = loop {
+                    if let Some(next) = info.queue.pop_front() {
+                        break next;
+                    }
                     if is_core_pool {
                         // Core pool never closes, wait forever.
-                        self.task_is_some.wait(&mut info);
+                        self.has_task.wait(&mut info);
                     } else {
                         let dur = Duration::from_secs(THREAD_IDLE_MAX_SEC);
-                        if self.task_is_some.wait_timeout(&mut info, dur).timed_out() {
+                        if self.has_task.wait_timeout(&mut info, dur).timed_out()
+                            && info.queue.is_empty()
+                        {
                             // Terminate thread after timeout
+                            info.idle_time += idle_start.elapsed();
                             info.idle_threads -= 1;
                             info.total_threads -= 1;
                             return;
                         }
                     }
-                }
-                task = info.task.take();
-                self.task_is_none.notify_one();
+                };
+                let now = Instant::now();
+                let wait = now - next.queued_at;
+                info.idle_time += now - idle_start;
+                info.wait_time += wait;
+                info.max_wait_time = info.max_wait_time.max(wait);
                 info.idle_threads -= 1;
+                task = next.task;
             }
-            if let Some(task) = task {
-                task();
-            }
+
+            let start = Instant::now();
+            task();
+            last_busy = start.elapsed().max(Duration::from_nanos(1));
+
             if getpid() == gettid() {
                 // This meant the current thread forked and became the main thread, exit
                 std::process::exit(0);
@@ -64,35 +185,183 @@ impl ThreadPool {
         }
     }
 
-    fn exec_task_impl(&self, f: impl FnOnce() + Send + 'static) {
+    // Never blocks. Returns false and drops the task if the pool is saturated,
+    // the caller is expected to shed the load.
+    pub fn submit(&'static self, f: impl FnOnce() + Send + 'static) -> bool {
+        let mut info = self.info.lock();
+        if info.queue.len() >= self.capacity {
+            info.rejected += 1;
+            return false;
+        }
+        self.enqueue(&mut info, Box::new(f));
+        true
+    }
+
+    // For tasks that can run for a very long time. They are never rejected or queued
+    // behind other tasks, a new thread is started if no worker is idle, ignoring the
+    // pool size limit.
+    pub fn submit_long(&'static self, f: impl FnOnce() + Send + 'static) {
+        let mut info = self.info.lock();
+        if info.idle_threads > info.queue.len() as i32 {
+            self.enqueue(&mut info, Box::new(f));
+        } else {
+            self.spawn_worker(&mut info, Some(Box::new(f)));
+        }
+    }
+
+    fn enqueue(&'static self, info: &mut PoolInfo, task: Task) {
+        info.queue.push_back(QueuedTask {
+            task,
+            queued_at: Instant::now(),
+        });
+        info.peak_queue = info.peak_queue.max(info.queue.len());
+
+        // Idle threads that are already notified still count as idle until they wake up,
+        // so compare against the queue depth to decide whether more workers are needed.
+        if info.idle_threads < info.queue.len() as i32 && info.total_threads < self.max_size {
+            self.spawn_worker(info, None);
+        } else {
+            self.has_task.notify_one();
+        }
+    }
+
+    fn spawn_worker(&'static self, info: &mut PoolInfo, first_task: Option<Task>) {
         extern "C" fn pool_loop_raw(arg: usize) -> usize {
-            let is_core_pool = arg != 0;
-            THREAD_POOL.pool_loop(is_core_pool);
+            let (pool, is_core_pool, first_task) =
+                *unsafe { Box::from_raw(arg as *mut (&'static ThreadPool, bool, Option<Task>)) };
+            pool.pool_loop(is_core_pool, first_task);
             0
         }
 
-        let mut info = self.info.lock();
-        while info.task.is_some() {
-            // Wait until task is none
-            self.task_is_none.wait(&mut info);
+        info.total_threads += 1;
+        info.peak_threads = info.peak_threads.max(info.total_threads);
+        let is_core_pool = info.total_threads <= self.core_size;
+        let arg = Box::into_raw(Box::new((self, is_core_pool, first_task)));
+        spawn_thread(pool_loop_raw, arg as usize);
+    }
+
+    pub fn stats(&self) -> PoolStats {
+        let info = self.info.lock();
+        PoolStats {
+            total_threads: info.total_threads,
+            idle_threads: info.idle_threads,
+            peak_threads: info.peak_threads,
+            queue_depth: info.queue.len(),
+            peak_queue: info.peak_queue,
+            completed: info.completed,
+            rejected: info.rejected,
+            wait_time: info.wait_time,
+            max_wait_time: info.max_wait_time,
+            busy_time: info.busy_time,
+            idle_time: info.idle_time,
         }
-        info.task = Some(Box::new(f));
-        if info.idle_threads == 0 {
-            info.total_threads += 1;
-            let is_core_thread = if info.total_threads <= CORE_POOL_SIZE {
-                1_usize
-            } else {
-                0_usize
-            };
-            unsafe {
-                new_daemon_thread(pool_loop_raw, is_core_thread);
+    }
+
+    pub fn exec_task(f: impl FnOnce() + Send + 'static) -> bool {
+        THREAD_POOL.submit(f)
+    }
+
+    pub fn exec_long_task(f: impl FnOnce() + Send + 'static) {
+        THREAD_POOL.submit_long(f);
+    }
+
+    pub fn global_stats() -> PoolStats {
+        THREAD_POOL.stats()
+    }
+}
+
+// Daemon threads are created in C++, which is only linked into the real binaries.
+// Unit tests run the same pool logic on plain std threads.
+#[cfg(not(test))]
+fn spawn_thread(entry: ThreadEntry, arg: usize) {
+    unsafe {
+        base::new_daemon_thread(entry, arg);
+    }
+}
+
+#[cfg(test)]
+fn spawn_thread(entry: ThreadEntry, arg: usize) {
+    std::thread::spawn(move || entry(arg));
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::thread::sleep;
+
+    static GATE: Mutex<bool> = Mutex::new(false);
+    static GATE_OPEN: Condvar = Condvar::new();
+    static STARTED: AtomicUsize = AtomicUsize::new(0);
+    static FINISHED: AtomicUsize = AtomicUsize::new(0);
+
+    fn blocking_task() {
+        STARTED.fetch_add(1, Ordering::SeqCst);
+        let mut open = GATE.lock();
+        while !*open {
+            GATE_OPEN.wait(&mut open);
+        }
+        drop(open);
+        FINISHED.fetch_add(1, Ordering::SeqCst);
+    }
+
+    fn wait_for(counter: &AtomicUsize, n: usize) -> bool {
+        let deadline = Instant::now() + Duration::from_secs(10);
+        while counter.load(Ordering::SeqCst) < n {
+            if Instant::now() > deadline {
+                return false;
             }
-        } else {
-            self.task_is_some.notify_one();
+            sleep(Duration::from_millis(1));
+        }
+        true
+    }
+
+    // Saturate the pool with tasks that never finish on their own, the submitter
+    // must never block and long tasks must still get a thread.
+    #[test]
+    fn saturated_pool_never_blocks() {
+        static POOL: ThreadPool = ThreadPool::new(2, 4, 8);
+        const LONG_TASKS: usize = 32;
+
+        let mut accepted = 0;
+        while POOL.submit(blocking_task) {
+            accepted += 1;
+            assert!(accepted <= 4 + 8 + 4, "bounded submit never rejected");
+        }
+        assert!(accepted >= 8);
+        assert_eq!(POOL.stats().rejected, 1);
+
+        let running = POOL.stats().total_threads as usize;
+        for _ in 0..LONG_TASKS {
+            POOL.submit_long(blocking_task);
         }
+        assert!(wait_for(&STARTED, running + LONG_TASKS));
+        assert!(POOL.stats().total_threads as usize >= running + LONG_TASKS);
+
+        *GATE.lock() = true;
+        GATE_OPEN.notify_all();
+        assert!(wait_for(&FINISHED, accepted + LONG_TASKS));
     }
 
-    pub fn exec_task(f: impl FnOnce() + Send + 'static) {
-        THREAD_POOL.exec_task_impl(f);
+    #[test]
+    fn short_tasks_under_load() {
+        static POOL: ThreadPool = ThreadPool::new(2, 8, 64);
+        static DONE: AtomicUsize = AtomicUsize::new(0);
+        const TASKS: usize = 10000;
+
+        let mut submitted = 0;
+        while submitted < TASKS {
+            if POOL.submit(|| {
+                DONE.fetch_add(1, Ordering::SeqCst);
+            }) {
+                submitted += 1;
+            } else {
+                std::thread::yield_now();
+            }
+        }
+        assert!(wait_for(&DONE, TASKS));
+        let stats = POOL.stats();
+        assert!(stats.peak_queue <= 64);
+        assert!(stats.total_threads <= 8);
     }
 }
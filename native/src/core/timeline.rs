@@ -0,0 +1,144 @@
+use crate::consts::SECURE_DIR;
+use crate::ffi::ScriptResult;
+use base::const_format::concatcp;
+use base::{ResultExt, Utf8CStr, libc};
+use std::fmt::Write as _;
+use std::fs;
+use std::fs::OpenOptions;
+use std::io::Write;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+// Timelines of the last few boots are kept as text files, the current boot is boot.0.
+// Every record is a single line appended with O_APPEND, so processes forked from
+// magiskd (e.g. the post-fs-data script runner) can write to it directly:
+//
+//   <start ms since boot> <duration ms, -1 if unknown> <kind> <stage> <name> <result>
+
+const TIMELINE_DIR: &str = concatcp!(SECURE_DIR, "/timeline");
+const MAX_TIMELINES: usize = 5;
+
+fn timeline_path(idx: usize) -> String {
+    format!("{TIMELINE_DIR}/boot.{idx}")
+}
+
+pub fn boot_time_ms() -> i64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_BOOTTIME, &mut ts) };
+    ts.tv_sec as i64 * 1000 + ts.tv_nsec as i64 / 1_000_000
+}
+
+fn append_record(
+    start_ms: i64,
+    duration_ms: i64,
+    kind: &str,
+    stage: &str,
+    name: &str,
+    result: &str,
+) {
+    // Records are only written after the timeline of this boot is started
+    let Ok(mut file) = OpenOptions::new().append(true).open(timeline_path(0)) else {
+        return;
+    };
+    let mut line = String::new();
+    writeln!(
+        line,
+        "{start_ms}\t{duration_ms}\t{kind}\t{stage}\t{name}\t{result}"
+    )
+    .ok();
+    file.write_all(line.as_bytes()).ok();
+}
+
+pub fn start_boot_timeline() {
+    fs::create_dir_all(TIMELINE_DIR).log_ok();
+    for idx in (1..MAX_TIMELINES).rev() {
+        fs::rename(timeline_path(idx - 1), timeline_path(idx)).ok();
+    }
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map_or(0, |d| d.as_secs());
+    fs::write(timeline_path(0), format!("# {now}\n")).log_ok();
+}
+
+// Records the time until it is dropped as a phase of the boot stage
+pub struct BootPhase {
+    stage: &'static str,
+    name: &'static str,
+    start_ms: i64,
+}
+
+pub fn boot_phase(stage: &'static str, name: &'static str) -> BootPhase {
+    BootPhase {
+        stage,
+        name,
+        start_ms: boot_time_ms(),
+    }
+}
+
+impl Drop for BootPhase {
+    fn drop(&mut self) {
+        let duration = boot_time_ms() - self.start_ms;
+        append_record(self.start_ms, duration, "phase", self.stage, self.name, "-");
+    }
+}
+
+// status is the wait status of the script, or -1 if it was not waited for
+pub fn record_boot_script(
+    stage: &Utf8CStr,
+    name: &str,
+    start_ms: i64,
+    result: ScriptResult,
+    status: i32,
+) {
+    let duration = boot_time_ms() - start_ms;
+    let (duration, result) = match result {
+        ScriptResult::Timeout => (duration, "timeout".to_string()),
+        ScriptResult::Detached => (-1, "detached".to_string()),
+        ScriptResult::Failed => (-1, "failed".to_string()),
+        ScriptResult::Exited if libc::WIFEXITED(status) => {
+            (duration, format!("exit={}", libc::WEXITSTATUS(status)))
+        }
+        ScriptResult::Exited if libc::WIFSIGNALED(status) => {
+            (duration, format!("signal={}", libc::WTERMSIG(status)))
+        }
+        ScriptResult::Exited => (duration, "-".to_string()),
+        _ => (-1, "async".to_string()),
+    };
+    append_record(start_ms, duration, "script", stage, name, &result);
+}
+
+pub fn print_boot_timeline() {
+    for idx in 0..MAX_TIMELINES {
+        let Ok(content) = fs::read_to_string(timeline_path(idx)) else {
+            continue;
+        };
+        let mut lines = content.lines();
+        let time = lines
+            .next()
+            .and_then(|l| l.strip_prefix("# "))
+            .unwrap_or("?");
+        println!("Boot {idx} (started at {time})");
+        println!(
+            "  {:>9} {:>9}  {:<6} {:<13} {:<32} RESULT",
+            "START", "DURATION", "KIND", "STAGE", "NAME"
+        );
+        for line in lines {
+            let fields: Vec<&str> = line.split('\t').collect();
+            let [start, duration, kind, stage, name, result] = fields[..] else {
+                continue;
+            };
+            let duration = if duration == "-1" {
+                "-".to_string()
+            } else {
+                format!("{duration}ms")
+            };
+            println!(
+                "  {:>9} {duration:>9}  {kind:<6} {stage:<13} {name:<32} {result}",
+                format!("{start}ms")
+            );
+        }
+        println!();
+    }
+}
@@ -0,0 +1,181 @@
+use crate::socket::{IpcRead, IpcWrite, UnixSocketExt};
+use crate::stats::Histogram;
+use crate::thread::ThreadPool;
+use base::{LoggedResult, ResultExt, fd_get_attr, libc};
+use std::io::BufWriter;
+use std::mem::ManuallyDrop;
+use std::os::fd::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::sync::OnceLock;
+use std::sync::nonpoison::Mutex;
+use std::time::{Duration, Instant};
+
+// zygiskd does nothing but run companion handlers, most of which block on their client
+// for the lifetime of the app process. It gets its own pool sized for that workload.
+static COMPANION_POOL: ThreadPool = ThreadPool::new(CORE_POOL_SIZE, MAX_POOL_SIZE, QUEUE_CAPACITY);
+
+const CORE_POOL_SIZE: i32 = 4;
+const MAX_POOL_SIZE: i32 = 256;
+const QUEUE_CAPACITY: usize = 256;
+// Companion handlers usually live as long as their app process, so they are never
+// queued or refused. Modules running more handlers than this at once are only
+// counted in the stats, as a hint of a module that never lets go of its clients.
+const MODULE_CONCURRENCY: usize = 16;
+
+// Sent by magiskd instead of a module id to collect the stats below
+pub const COMPANION_STATS_REQUEST: i32 = -2;
+
+type CompanionEntry = extern "C" fn(RawFd);
+
+struct Module {
+    entry: Option<CompanionEntry>,
+    state: Mutex<ModuleState>,
+    // From receiving the client to the handler being called
+    wait_time: Histogram,
+    run_time: Histogram,
+}
+
+#[derive(Default)]
+struct ModuleState {
+    running: usize,
+    peak_running: usize,
+    // Handlers started while MODULE_CONCURRENCY others were already running
+    over_limit: u64,
+    completed: u64,
+}
+
+static MODULES: OnceLock<Vec<Module>> = OnceLock::new();
+
+#[unsafe(no_mangle)]
+extern "C" fn init_companion_entries(entries: *const Option<CompanionEntry>, len: usize) {
+    let entries = unsafe { std::slice::from_raw_parts(entries, len) };
+    let modules = entries
+        .iter()
+        .map(|entry| Module {
+            entry: *entry,
+            state: Mutex::new(ModuleState::default()),
+            wait_time: Histogram::new(),
+            run_time: Histogram::new(),
+        })
+        .collect();
+    MODULES.set(modules).ok();
+}
+
+#[unsafe(no_mangle)]
+extern "C" fn exec_companion_entry(client: RawFd) {
+    let received = Instant::now();
+    COMPANION_POOL.submit_long(move || dispatch_client(client, received));
+}
+
+fn dispatch_client(client: RawFd, received: Instant) {
+    // The module id is read here instead of the accept loop,
+    // so a slow client cannot hold up everyone else.
+    let mut stream = ManuallyDrop::new(unsafe { UnixStream::from_raw_fd(client) });
+    let module_id = stream.read_decodable::<i32>().unwrap_or(-1);
+    if module_id == COMPANION_STATS_REQUEST {
+        write_companion_stats(&mut stream).ok();
+        unsafe { libc::close(client) };
+        return;
+    }
+
+    let Some((module, entry)) = MODULES
+        .get()
+        .and_then(|m| m.get(usize::try_from(module_id).ok()?))
+        .and_then(|m| Some((m, m.entry?)))
+    else {
+        unsafe { libc::close(client) };
+        return;
+    };
+
+    {
+        let mut state = module.state.lock();
+        if state.running >= MODULE_CONCURRENCY {
+            state.over_limit += 1;
+        }
+        state.running += 1;
+        state.peak_running = state.peak_running.max(state.running);
+    }
+
+    let start = Instant::now();
+    module.wait_time.record(start - received);
+    run_companion(entry, client);
+    module.run_time.record(start.elapsed());
+
+    let mut state = module.state.lock();
+    state.running -= 1;
+    state.completed += 1;
+}
+
+fn run_companion(entry: CompanionEntry, client: RawFd) {
+    let Ok(s1) = fd_get_attr(client) else {
+        return;
+    };
+
+    entry(client);
+
+    // Only close client if it is the same file so we don't
+    // accidentally close a re-used file descriptor.
+    // This check is required because the module companion
+    // handler could've closed the file descriptor already.
+    if let Ok(s2) = fd_get_attr(client)
+        && s1.st.st_dev == s2.st.st_dev
+        && s1.st.st_ino == s2.st.st_ino
+    {
+        unsafe { libc::close(client) };
+    }
+}
+
+fn write_companion_stats(client: &mut UnixStream) -> LoggedResult<()> {
+    let mut report = Vec::new();
+    COMPANION_POOL.stats().dump("pool", &mut report);
+    for (id, module) in MODULES.get().into_iter().flatten().enumerate() {
+        let state = module.state.lock();
+        if state.completed == 0 && state.running == 0 {
+            continue;
+        }
+        report.push(format!("module{id}.running={}", state.running));
+        report.push(format!("module{id}.running_peak={}", state.peak_running));
+        report.push(format!("module{id}.over_limit={}", state.over_limit));
+        report.push(format!("module{id}.completed={}", state.completed));
+        drop(state);
+        module
+            .wait_time
+            .dump(&format!("module{id}.wait"), &mut report);
+        module
+            .run_time
+            .dump(&format!("module{id}.run"), &mut report);
+    }
+
+    let mut writer = BufWriter::new(client);
+    for line in &report {
+        writer.write_encodable(line)?;
+    }
+    writer.write_encodable("").log()
+}
+
+// Collect stats from a running zygiskd through its request socket
+fn query_companion_stats(zygiskd: &mut UnixStream) -> LoggedResult<Vec<String>> {
+    let (mut local, remote) = UnixStream::pair()?;
+    local.set_read_timeout(Some(Duration::from_secs(1)))?;
+    zygiskd.send_fds(&[remote.as_raw_fd()])?;
+    drop(remote);
+    local.write_encodable(&COMPANION_STATS_REQUEST)?;
+    let mut lines = Vec::new();
+    loop {
+        let line: String = local.read_decodable()?;
+        if line.is_empty() {
+            break;
+        }
+        lines.push(line);
+    }
+    Ok(lines)
+}
+
+// Must not be called with the zygisk state lock held, every query can take up to a second
+pub fn dump_companion_stats(sockets: Vec<(&str, UnixStream)>, out: &mut Vec<String>) {
+    for (name, mut socket) in sockets {
+        if let Ok(lines) = query_companion_stats(&mut socket) {
+            out.extend(lines.iter().map(|line| format!("{name}.{line}")));
+        }
+    }
+}
@@ -0,0 +1,251 @@
+use crate::ffi::ModuleInfo;
+use crate::stats::Histogram;
+use bytemuck::{Pod, Zeroable};
+use std::collections::BTreeMap;
+use std::mem::size_of;
+use std::sync::nonpoison::Mutex;
+use std::time::Duration;
+
+// Every specialized process reports what zygisk and its modules cost it as a binary
+// record through the log pipe. The layout has to match ZygiskCostRecord in zygisk/module.hpp.
+
+#[derive(Copy, Clone, Pod, Zeroable)]
+#[repr(C)]
+struct RecordHeader {
+    is_server: u32,
+    module_count: u32,
+    plt_commit_us: u32,
+    plt_commit_count: u32,
+    sanitize_fds_us: u32,
+    // From the start of specialization to the end of the post callbacks
+    rss_delta_kb: i32,
+    lib_delta: i32,
+    reserved: u32,
+}
+
+#[derive(Copy, Clone, Pod, Zeroable)]
+#[repr(C)]
+struct ModuleRecord {
+    id: i32,
+    pre_us: u32,
+    post_us: u32,
+    // Over both the pre and post callbacks
+    rss_delta_kb: i32,
+    lib_delta: i32,
+}
+
+#[derive(Default)]
+struct MemoryDelta {
+    count: u64,
+    rss_kb: i64,
+    libs: i64,
+}
+
+impl MemoryDelta {
+    fn add(&mut self, rss_kb: i32, libs: i32) {
+        self.count += 1;
+        self.rss_kb += rss_kb as i64;
+        self.libs += libs as i64;
+    }
+
+    fn avg(&self) -> (i64, f64) {
+        if self.count == 0 {
+            return (0, 0.0);
+        }
+        (
+            self.rss_kb / self.count as i64,
+            self.libs as f64 / self.count as f64,
+        )
+    }
+}
+
+struct ModuleCost {
+    pre: Histogram,
+    post: Histogram,
+    memory: MemoryDelta,
+}
+
+struct SpecializeCost {
+    apps: u64,
+    servers: u64,
+    plt_commit: Histogram,
+    sanitize_fds: Histogram,
+    memory: MemoryDelta,
+    modules: BTreeMap<i32, ModuleCost>,
+}
+
+static COST: Mutex<SpecializeCost> = Mutex::new(SpecializeCost {
+    apps: 0,
+    servers: 0,
+    plt_commit: Histogram::new(),
+    sanitize_fds: Histogram::new(),
+    memory: MemoryDelta {
+        count: 0,
+        rss_kb: 0,
+        libs: 0,
+    },
+    modules: BTreeMap::new(),
+});
+
+fn micros(us: u32) -> Duration {
+    Duration::from_micros(us as u64)
+}
+
+// Called by the log daemon for every record received from zygisk
+pub fn record_specialize_cost(data: &[u8]) {
+    if data.len() < size_of::<RecordHeader>() {
+        return;
+    }
+    let header: RecordHeader = bytemuck::pod_read_unaligned(&data[..size_of::<RecordHeader>()]);
+    let modules = &data[size_of::<RecordHeader>()..];
+    if modules.len() != header.module_count as usize * size_of::<ModuleRecord>() {
+        return;
+    }
+
+    let mut cost = COST.lock();
+    if header.is_server != 0 {
+        cost.servers += 1;
+    } else {
+        cost.apps += 1;
+    }
+    if header.plt_commit_count > 0 {
+        cost.plt_commit.record(micros(header.plt_commit_us));
+    }
+    if header.sanitize_fds_us > 0 {
+        cost.sanitize_fds.record(micros(header.sanitize_fds_us));
+    }
+    cost.memory.add(header.rss_delta_kb, header.lib_delta);
+    for chunk in modules.chunks_exact(size_of::<ModuleRecord>()) {
+        let record: ModuleRecord = bytemuck::pod_read_unaligned(chunk);
+        let module = cost.modules.entry(record.id).or_insert_with(|| ModuleCost {
+            pre: Histogram::new(),
+            post: Histogram::new(),
+            memory: MemoryDelta::default(),
+        });
+        module.pre.record(micros(record.pre_us));
+        module.post.record(micros(record.post_us));
+        module.memory.add(record.rss_delta_kb, record.lib_delta);
+    }
+}
+
+pub fn dump_specialize_cost(module_list: Option<&Vec<ModuleInfo>>, out: &mut Vec<String>) {
+    let cost = COST.lock();
+    out.push(format!(
+        "specializations: app={} server={}",
+        cost.apps, cost.servers
+    ));
+    cost.plt_commit.dump("plt_hook_commit", out);
+    cost.sanitize_fds.dump("sanitize_fds", out);
+    let (rss_kb, libs) = cost.memory.avg();
+    out.push(format!(
+        "process: avg_rss_delta_kb={rss_kb} avg_lib_delta={libs:.1}"
+    ));
+    if cost.modules.is_empty() {
+        return;
+    }
+
+    out.push(format!(
+        "{:<24} {:>7} {:>9} {:>9} {:>9} {:>9} {:>8} {:>6}",
+        "MODULE", "COUNT", "PRE_AVG", "PRE_P99", "POST_AVG", "POST_P99", "RSS_KB", "LIBS"
+    ));
+    for (id, module) in &cost.modules {
+        let name = module_list
+            .and_then(|list| list.get(*id as usize))
+            .map_or_else(|| format!("#{id}"), |m| m.name.clone());
+        let (rss_kb, libs) = module.memory.avg();
+        out.push(format!(
+            "{name:<24} {:>7} {:>7}us {:>7}us {:>7}us {:>7}us {rss_kb:>8} {libs:>6.1}",
+            module.pre.count(),
+            module.pre.avg(),
+            module.pre.percentile(99),
+            module.post.avg(),
+            module.post.percentile(99),
+        ));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn encode(header: RecordHeader, modules: &[ModuleRecord]) -> Vec<u8> {
+        let mut data = bytemuck::bytes_of(&header).to_vec();
+        for module in modules {
+            data.extend_from_slice(bytemuck::bytes_of(module));
+        }
+        data
+    }
+
+    fn header(is_server: u32, module_count: u32) -> RecordHeader {
+        RecordHeader {
+            is_server,
+            module_count,
+            plt_commit_us: 120,
+            plt_commit_count: 3,
+            sanitize_fds_us: 40,
+            rss_delta_kb: 256,
+            lib_delta: 2,
+            reserved: 0,
+        }
+    }
+
+    fn module(id: i32) -> ModuleRecord {
+        ModuleRecord {
+            id,
+            pre_us: 500,
+            post_us: 700,
+            rss_delta_kb: 64,
+            lib_delta: 1,
+        }
+    }
+
+    // Must stay in sync with ZygiskCostRecord in zygisk/module.hpp
+    #[test]
+    fn record_layout() {
+        assert_eq!(size_of::<RecordHeader>(), 32);
+        assert_eq!(size_of::<ModuleRecord>(), 20);
+        // Same offsets as the static_asserts in zygisk/module.hpp
+        assert_eq!(std::mem::offset_of!(ModuleRecord, post_us), 8);
+        assert_eq!(std::mem::offset_of!(ModuleRecord, lib_delta), 16);
+        assert_eq!(std::mem::offset_of!(RecordHeader, sanitize_fds_us), 16);
+        assert_eq!(std::mem::offset_of!(RecordHeader, lib_delta), 24);
+    }
+
+    // COST is global, so all checks touching it live in a single test
+    #[test]
+    fn record_specialize_cost_checks_length() {
+        let (apps, servers) = {
+            let cost = COST.lock();
+            (cost.apps, cost.servers)
+        };
+
+        record_specialize_cost(&encode(header(0, 2), &[module(1000), module(1001)]));
+        record_specialize_cost(&encode(header(1, 0), &[]));
+        {
+            let cost = COST.lock();
+            assert_eq!(cost.apps, apps + 1);
+            assert_eq!(cost.servers, servers + 1);
+            for id in [1000, 1001] {
+                let module = &cost.modules[&id];
+                assert_eq!(module.pre.count(), 1);
+                assert_eq!(module.post.count(), 1);
+                assert_eq!(module.memory.avg(), (64, 1.0));
+            }
+        }
+
+        // Truncated header
+        let data = encode(header(0, 0), &[]);
+        record_specialize_cost(&data[..size_of::<RecordHeader>() - 1]);
+        // Truncated module records
+        let data = encode(header(0, 1), &[module(1002)]);
+        record_specialize_cost(&data[..data.len() - 1]);
+        // Module count not matching the payload
+        record_specialize_cost(&encode(header(0, 2), &[module(1003)]));
+        record_specialize_cost(&encode(header(0, 0), &[module(1004)]));
+
+        let cost = COST.lock();
+        assert_eq!(cost.apps, apps + 1);
+        assert_eq!(cost.servers, servers + 1);
+        assert!((1002..=1004).all(|id| !cost.modules.contains_key(&id)));
+    }
+}
@@ -1,8 +1,9 @@
 use crate::consts::MODULEROOT;
 use crate::daemon::{MagiskD, to_user_id};
-use crate::ffi::{ZygiskRequest, ZygiskStateFlags, get_magisk_tmp, update_deny_flags};
+use crate::ffi::{DbEntryKey, ZygiskRequest, ZygiskStateFlags, get_magisk_tmp};
 use crate::resetprop::{get_prop, set_prop};
 use crate::socket::{IpcRead, UnixSocketExt};
+use crate::stats::{Stage, span};
 use base::libc::STDOUT_FILENO;
 use base::{
     Directory, FsPathBuilder, LoggedResult, ResultExt, Utf8CStr, WriteExt, cstr, fork_dont_care,
@@ -14,11 +15,19 @@ use std::os::fd::{AsRawFd, RawFd};
 use std::os::unix::net::UnixStream;
 use std::ptr;
 use std::sync::atomic::Ordering;
+use std::sync::nonpoison::Mutex;
 
 const NBPROP: &Utf8CStr = cstr!("ro.dalvik.vm.native.bridge");
 const ZYGISKLDR: &str = "libzygisk.so";
 const UNMOUNT_MASK: u32 =
     ZygiskStateFlags::ProcessOnDenyList.repr | ZygiskStateFlags::DenyListEnforced.repr;
+const NO_CACHE_MASK: u32 =
+    ZygiskStateFlags::ProcessGrantedRoot.repr | ZygiskStateFlags::ProcessIsMagiskApp.repr;
+// SCM_RIGHTS can carry at most 253 fds in a single message
+const MAX_CLIENT_BATCH: usize = 64;
+
+// Clients waiting to be passed to zygiskd, indexed by is_64_bit
+static PENDING_CLIENTS: Mutex<[Vec<UnixStream>; 2]> = Mutex::new([Vec::new(), Vec::new()]);
 
 pub fn zygisk_should_load_module(flags: u32) -> bool {
     flags & UNMOUNT_MASK != UNMOUNT_MASK && flags & ZygiskStateFlags::ProcessIsMagiskApp.repr == 0
@@ -66,8 +75,7 @@ pub struct ZygiskState {
 }
 
 impl ZygiskState {
-    fn connect_zygiskd(&mut self, mut client: UnixStream, daemon: &MagiskD) -> LoggedResult<()> {
-        let is_64_bit: bool = client.read_decodable()?;
+    fn zygiskd_socket(&mut self, is_64_bit: bool) -> &mut Option<UnixStream> {
         let socket = if is_64_bit {
             &mut self.sockets.1
         } else {
@@ -86,10 +94,17 @@ impl ZygiskState {
                 *socket = None;
             }
         }
+        socket
+    }
 
-        if let Some(fd) = socket {
-            fd.send_fds(&[client.as_raw_fd()])?;
-        } else {
+    fn connect_zygiskd(
+        &mut self,
+        is_64_bit: bool,
+        clients: &[UnixStream],
+        daemon: &MagiskD,
+    ) -> LoggedResult<()> {
+        let socket = self.zygiskd_socket(is_64_bit);
+        if socket.is_none() {
             // Create a new socket pair and fork zygiskd process
             let (mut local, remote) = UnixStream::pair()?;
             if fork_dont_care() == 0 {
@@ -101,12 +116,33 @@ impl ZygiskState {
             if local.read_decodable::<i32>()? != 0 {
                 return log_err!();
             }
-            local.send_fds(&[client.as_raw_fd()])?;
             *socket = Some(local);
         }
+
+        if let Some(fd) = socket {
+            for batch in clients.chunks(MAX_CLIENT_BATCH) {
+                let fds: Vec<RawFd> = batch.iter().map(|c| c.as_raw_fd()).collect();
+                fd.send_fds(&fds)?;
+            }
+        }
         Ok(())
     }
 
+    // Duplicates of the live zygiskd sockets, so they can be used without holding the
+    // state lock. Querying a zygiskd can block for a while.
+    pub fn companion_sockets(&mut self) -> Vec<(&'static str, UnixStream)> {
+        let mut sockets = Vec::new();
+        for is_64_bit in [false, true] {
+            let name = if is_64_bit { "zygiskd64" } else { "zygiskd32" };
+            if let Some(socket) = self.zygiskd_socket(is_64_bit)
+                && let Ok(socket) = socket.try_clone().log()
+            {
+                sockets.push((name, socket));
+            }
+        }
+        sockets
+    }
+
     pub fn reset(&mut self, mut restore: bool) {
         if restore {
             self.start_count = 1;
@@ -163,18 +199,31 @@ impl MagiskD {
             };
             match code {
                 ZygiskRequest::GetInfo => self.get_process_info(client)?,
-                ZygiskRequest::ConnectCompanion => self
-                    .zygisk
-                    .lock()
-                    .connect_zygiskd(client, self)
-                    .log_with_msg(|w| w.write_str("zygiskd startup error"))?,
+                ZygiskRequest::ConnectCompanion => self.connect_companion(client)?,
                 ZygiskRequest::GetModDir => self.get_mod_dir(client)?,
+                ZygiskRequest::GetFlagsMap => self.get_flags_map(client)?,
                 _ => {}
             }
             Ok(())
         }();
     }
 
+    fn connect_companion(&self, mut client: UnixStream) -> LoggedResult<()> {
+        let is_64_bit: bool = client.read_decodable()?;
+        PENDING_CLIENTS.lock()[is_64_bit as usize].push(client);
+
+        let mut zygisk = self.zygisk.lock();
+        // Whoever gets the lock first sends every client queued up in the meantime
+        // in one go. If that already included ours, there is nothing left to do.
+        let clients = std::mem::take(&mut PENDING_CLIENTS.lock()[is_64_bit as usize]);
+        if clients.is_empty() {
+            return Ok(());
+        }
+        zygisk
+            .connect_zygiskd(is_64_bit, &clients, self)
+            .log_with_msg(|w| w.write_str("zygiskd startup error"))
+    }
+
     fn get_module_fds(&self, is_64_bit: bool) -> Option<Vec<RawFd>> {
         self.module_list.get().map(|module_list| {
             module_list
@@ -192,13 +241,31 @@ impl MagiskD {
         let uid: i32 = client.read_decodable()?;
         let process: String = client.read_decodable()?;
         let is_64_bit: bool = client.read_decodable()?;
-        let mut flags: u32 = 0;
-        update_deny_flags(uid, &process, &mut flags);
-        if self.get_manager_uid(to_user_id(uid)) == uid {
-            flags |= ZygiskStateFlags::ProcessIsMagiskApp.repr
-        }
-        if self.uid_granted_root(uid) {
-            flags |= ZygiskStateFlags::ProcessGrantedRoot.repr
+
+        // Only time the lookup, not the client IO around it
+        let (table, flags) = {
+            let _span = span(Stage::ZygiskGetInfo);
+            let table = self.decision_table();
+            let mut flags = table.deny_flags(uid, &process);
+            if self.get_manager_uid(to_user_id(uid)) == uid {
+                flags |= ZygiskStateFlags::ProcessIsMagiskApp.repr
+            }
+            if table.uid_granted_root(uid) {
+                flags |= ZygiskStateFlags::ProcessGrantedRoot.repr
+            }
+            (table, flags)
+        };
+
+        // Let future forks of the same process skip this request if they would not load
+        // any modules. Root grants can expire and the manager can be reinstalled at any
+        // time, so those processes always have to ask.
+        let no_modules = self.module_list.get().is_none_or(|list| list.is_empty());
+        if table.is_loaded()
+            && flags & NO_CACHE_MASK == 0
+            && (no_modules || !zygisk_should_load_module(flags))
+        {
+            self.flags_map
+                .insert(table.generation(), uid, &process, flags);
         }
 
         // First send flags
@@ -239,6 +306,18 @@ impl MagiskD {
         Ok(())
     }
 
+    fn get_flags_map(&self, mut client: UnixStream) -> LoggedResult<()> {
+        let generation = self.decision_generation.load(Ordering::Acquire);
+        match self.flags_map.get_fd(generation) {
+            Some(fd) => client.send_fds(&[fd])?,
+            None => client.send_fds(&[])?,
+        }
+        // Measuring specialization cost is not free, zygote only does it when asked to
+        let report_cost = self.get_db_setting(DbEntryKey::ZygiskCost) != 0;
+        client.write_pod(&(report_cost as i32))?;
+        Ok(())
+    }
+
     fn get_mod_dir(&self, mut client: UnixStream) -> LoggedResult<()> {
         let id: i32 = client.read_decodable()?;
         let Some(module) = self
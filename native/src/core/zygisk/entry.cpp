@@ -11,7 +11,8 @@
 using namespace std;
 
 using comp_entry = void(*)(int);
-extern "C" void exec_companion_entry(int, comp_entry);
+extern "C" void init_companion_entries(const comp_entry *, size_t);
+extern "C" void exec_companion_entry(int);
 
 static void zygiskd(int socket) {
     if (getuid() != 0 || fcntl(socket, F_GETFD) < 0)
@@ -48,6 +49,8 @@ static void zygiskd(int socket) {
         }
     }
 
+    init_companion_entries(modules.data(), modules.size());
+
     // ack
     write_int(socket, 0);
 
@@ -59,16 +62,14 @@ static void zygiskd(int socket) {
             // Something bad happened in magiskd, terminate zygiskd
             exit(0);
         }
-        int client = recv_fd(socket);
-        if (client < 0) {
+        // magiskd may pass several clients at once
+        auto clients = recv_fds(socket);
+        if (clients.empty()) {
             // Something bad happened in magiskd, terminate zygiskd
             exit(0);
         }
-        int module_id = read_int(client);
-        if (module_id >= 0 && module_id < modules.size() && modules[module_id]) {
-            exec_companion_entry(client, modules[module_id]);
-        } else {
-            close(client);
+        for (int client : clients) {
+            exec_companion_entry(client);
         }
     }
 }
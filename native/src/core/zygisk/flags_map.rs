@@ -0,0 +1,202 @@
+use base::{FsPathBuilder, LoggedResult, ResultExt, cstr};
+use nix::fcntl::{FcntlArg, OFlag, SealFlag, fcntl};
+use nix::sys::memfd::{MFdFlags, memfd_create};
+use nix::sys::mman::{MapFlags, ProtFlags, mmap};
+use nix::unistd::ftruncate;
+use std::mem::size_of;
+use std::num::NonZeroUsize;
+use std::os::fd::{AsRawFd, OwnedFd, RawFd};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, Ordering, fence};
+use std::sync::nonpoison::Mutex;
+
+// A read-only hash table of (uid, process) -> ZygiskStateFlags shared with zygote.
+// App processes look up their flags here and skip the round trip to magiskd.
+// The layout has to match ZygiskFlagsMap in zygisk/module.hpp.
+
+const FLAGS_MAP_MAGIC: u32 = 0x5a464d31;
+const FLAGS_MAP_CAPACITY: usize = 2048;
+const PROCESS_NAME_MAX: usize = 120;
+
+#[repr(C)]
+struct Entry {
+    uid: i32,
+    flags: u32,
+    // NUL terminated, an empty name marks an unused slot
+    process: [u8; PROCESS_NAME_MAX],
+}
+
+#[repr(C)]
+struct Header {
+    magic: u32,
+    // Odd while the table is being modified
+    seq: AtomicU32,
+    capacity: u32,
+    reserved: u32,
+}
+
+#[repr(C)]
+struct Table {
+    header: Header,
+    entries: [Entry; FLAGS_MAP_CAPACITY],
+}
+
+// FNV-1a over the uid followed by the process name
+fn entry_hash(uid: i32, process: &[u8]) -> usize {
+    let mut h: u32 = 0x811c9dc5;
+    for b in uid.to_le_bytes().iter().chain(process) {
+        h ^= *b as u32;
+        h = h.wrapping_mul(0x01000193);
+    }
+    h as usize
+}
+
+struct Region {
+    table: NonNull<Table>,
+    // The read-only fd handed out to zygote
+    fd: OwnedFd,
+    count: usize,
+    generation: u32,
+}
+
+unsafe impl Send for Region {}
+
+impl Region {
+    fn new(generation: u32) -> LoggedResult<Region> {
+        let memfd = memfd_create(
+            cstr!("zygisk-flags"),
+            MFdFlags::MFD_CLOEXEC | MFdFlags::MFD_ALLOW_SEALING,
+        )?;
+        let len = size_of::<Table>();
+        ftruncate(&memfd, len as _)?;
+        let ptr = unsafe {
+            mmap(
+                None,
+                NonZeroUsize::new_unchecked(len),
+                ProtFlags::PROT_READ | ProtFlags::PROT_WRITE,
+                MapFlags::MAP_SHARED,
+                &memfd,
+                0,
+            )?
+        };
+        let table = ptr.cast::<Table>();
+        unsafe {
+            let header = &mut (*table.as_ptr()).header;
+            header.magic = FLAGS_MAP_MAGIC;
+            header.capacity = FLAGS_MAP_CAPACITY as u32;
+        }
+
+        // Only our existing mapping can modify the table from now on. F_SEAL_FUTURE_WRITE
+        // is not available before Linux 5.1, the fd being read-only is enough in that case.
+        fcntl(&memfd, FcntlArg::F_ADD_SEALS(SealFlag::F_SEAL_FUTURE_WRITE)).ok();
+        fcntl(
+            &memfd,
+            FcntlArg::F_ADD_SEALS(
+                SealFlag::F_SEAL_SHRINK | SealFlag::F_SEAL_GROW | SealFlag::F_SEAL_SEAL,
+            ),
+        )?;
+        let fd = cstr::buf::new::<64>()
+            .join_path("/proc/self/fd")
+            .join_path_fmt(memfd.as_raw_fd())
+            .open(OFlag::O_RDONLY | OFlag::O_CLOEXEC)?
+            .into();
+
+        Ok(Region {
+            table,
+            fd,
+            count: 0,
+            generation,
+        })
+    }
+
+    fn table(&mut self) -> &mut Table {
+        unsafe { self.table.as_mut() }
+    }
+
+    // Readers retry or fall back to magiskd if the sequence changed during the lookup
+    fn write(&mut self, f: impl FnOnce(&mut Region)) {
+        let seq = &self.table().header.seq;
+        seq.fetch_add(1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        f(self);
+        self.table().header.seq.fetch_add(1, Ordering::Release);
+    }
+
+    fn clear(&mut self) {
+        self.write(|r| {
+            for entry in &mut r.table().entries {
+                entry.process[0] = 0;
+            }
+            r.count = 0;
+        });
+    }
+
+    fn insert(&mut self, uid: i32, process: &[u8], flags: u32) {
+        // Keep the load factor low so lookups in the children stay short
+        if self.count >= FLAGS_MAP_CAPACITY * 3 / 4 {
+            self.clear();
+        }
+        let mut idx = entry_hash(uid, process) % FLAGS_MAP_CAPACITY;
+        loop {
+            let entry = &self.table().entries[idx];
+            if entry.process[0] == 0 {
+                break;
+            }
+            if entry.uid == uid
+                && entry.process[..process.len()] == *process
+                && entry.process[process.len()] == 0
+            {
+                break;
+            }
+            idx = (idx + 1) % FLAGS_MAP_CAPACITY;
+        }
+        if self.table().entries[idx].process[0] == 0 {
+            self.count += 1;
+        }
+        self.write(|r| {
+            let entry = &mut r.table().entries[idx];
+            entry.uid = uid;
+            entry.flags = flags;
+            entry.process[..process.len()].copy_from_slice(process);
+            entry.process[process.len()] = 0;
+        });
+    }
+}
+
+#[derive(Default)]
+pub struct FlagsMap {
+    region: Mutex<Option<Region>>,
+}
+
+impl FlagsMap {
+    // Returns the read-only fd of the table, creating it on first use
+    pub fn get_fd(&self, generation: u32) -> Option<RawFd> {
+        let mut region = self.region.lock();
+        if region.is_none() {
+            *region = Region::new(generation).log().ok();
+        }
+        region.as_ref().map(|r| r.fd.as_raw_fd())
+    }
+
+    // Entries computed from a stale decision table are dropped
+    pub fn insert(&self, generation: u32, uid: i32, process: &str, flags: u32) {
+        let process = process.as_bytes();
+        if process.is_empty() || process.len() >= PROCESS_NAME_MAX {
+            return;
+        }
+        let mut region = self.region.lock();
+        if let Some(region) = region.as_mut()
+            && region.generation == generation
+        {
+            region.insert(uid, process, flags);
+        }
+    }
+
+    pub fn clear(&self, generation: u32) {
+        let mut region = self.region.lock();
+        if let Some(region) = region.as_mut() {
+            region.generation = region.generation.max(generation);
+            region.clear();
+        }
+    }
+}
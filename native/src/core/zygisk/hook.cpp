@@ -100,10 +100,13 @@ using JNIMethodsDyn = std::pair<unique_ptr<JNINativeMethod[]>, size_t>;
 struct HookContext : JniHookDefinitions {
 
     vector<tuple<dev_t, ino_t, const char *, void **>> plt_backup;
+    // All libraries we look for are loaded before Zygisk, so the maps are only scanned once
+    vector<lsplt::MapInfo> maps;
     const NativeBridgeRuntimeCallbacks *runtime_callbacks = nullptr;
     void *self_handle = nullptr;
     bool should_unmap = false;
 
+    const vector<lsplt::MapInfo> &get_maps();
     void hook_plt();
     void hook_unloader();
     void restore_plt_hook();
@@ -226,15 +229,9 @@ DCL_HOOK_FUNC(static int, pthread_attr_destroy, void *target) {
 
 // -----------------------------------------------------------------
 
-static size_t get_fd_max() {
-    rlimit r{32768, 32768};
-    getrlimit(RLIMIT_NOFILE, &r);
-    return r.rlim_max;
-}
-
 ZygiskContext::ZygiskContext(JNIEnv *env, void *args) :
     env(env), args{args}, process(nullptr), pid(-1), flags(0), info_flags(0),
-    allowed_fds(get_fd_max()), hook_info_lock(PTHREAD_MUTEX_INITIALIZER) { g_ctx = this; }
+    fd_scan_us(0), cost_start{}, cost{}, hook_info_lock(PTHREAD_MUTEX_INITIALIZER) { g_ctx = this; }
 
 ZygiskContext::~ZygiskContext() {
     // This global pointer points to a variable on the stack.
@@ -286,7 +283,7 @@ inline void *unwind_get_region_start(_Unwind_Context *ctx) {
 static const NativeBridgeRuntimeCallbacks* find_runtime_callbacks(struct _Unwind_Context *ctx) {
     // Find the writable memory region of libart.so, where the NativeBridgeRuntimeCallbacks is located.
     auto [start, end] = []()-> tuple<uintptr_t, uintptr_t> {
-        for (const auto &map : lsplt::MapInfo::Scan()) {
+        for (const auto &map : g_hook->get_maps()) {
             if (map.path.ends_with("/libart.so") && map.perms == (PROT_WRITE | PROT_READ)) {
                 ZLOGV("libart.so: start=%p, end=%p\n",
                       reinterpret_cast<void *>(map.start), reinterpret_cast<void *>(map.end));
@@ -398,13 +395,22 @@ void HookContext::register_hook(
 #define PLT_HOOK_REGISTER(DEV, INODE, NAME) \
     PLT_HOOK_REGISTER_SYM(DEV, INODE, #NAME, NAME)
 
+const vector<lsplt::MapInfo> &HookContext::get_maps() {
+    if (maps.empty()) {
+        maps = lsplt::MapInfo::Scan();
+        // Only shared libraries are ever looked up, don't keep the rest alive in zygote
+        std::erase_if(maps, [](const auto &map) { return !map.path.ends_with(".so"); });
+    }
+    return maps;
+}
+
 void HookContext::hook_plt() {
     ino_t android_runtime_inode = 0;
     dev_t android_runtime_dev = 0;
     ino_t native_bridge_inode = 0;
     dev_t native_bridge_dev = 0;
 
-    for (auto &map : lsplt::MapInfo::Scan()) {
+    for (auto &map : get_maps()) {
         if (map.path.ends_with("/libandroid_runtime.so")) {
             android_runtime_inode = map.inode;
             android_runtime_dev = map.dev;
@@ -432,7 +438,7 @@ void HookContext::hook_unloader() {
     ino_t art_inode = 0;
     dev_t art_dev = 0;
 
-    for (auto &map : lsplt::MapInfo::Scan()) {
+    for (auto &map : get_maps()) {
         if (map.path.ends_with("/libart.so")) {
             art_inode = map.inode;
             art_dev = map.dev;
@@ -536,7 +542,7 @@ void HookContext::hook_zygote_jni() {
     auto get_created_vms = reinterpret_cast<method_sig>(
             dlsym(RTLD_DEFAULT, "JNI_GetCreatedJavaVMs"));
     if (!get_created_vms) {
-        for (auto &map: lsplt::MapInfo::Scan()) {
+        for (auto &map: get_maps()) {
             if (!map.path.ends_with("/libnativehelper.so")) continue;
             void *h = dlopen(map.path.data(), RTLD_LAZY);
             if (!h) {
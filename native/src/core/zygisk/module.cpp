@@ -1,6 +1,11 @@
 #include <sys/mman.h>
 #include <android/dlext.h>
 #include <dlfcn.h>
+#include <sys/syscall.h>
+#include <link.h>
+#include <algorithm>
+#include <set>
+#include <tuple>
 
 #include <lsplt.hpp>
 
@@ -18,8 +23,47 @@ static int zygisk_request(int req) {
     return fd;
 }
 
+static int64_t now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Set by magiskd with the zygisk_cost setting, inherited by every child of zygote
+static bool report_cost = false;
+
+CostProbe CostProbe::now() {
+    CostProbe probe{ .time_us = now_us(), .rss_kb = 0, .libs = 0 };
+    if (!report_cost)
+        return probe;
+    // The second field of statm is the resident set size in pages
+    if (int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC); fd >= 0) {
+        char buf[128];
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len > 0) {
+            buf[len] = '\0';
+            long size, resident;
+            if (sscanf(buf, "%ld %ld", &size, &resident) == 2)
+                probe.rss_kb = resident * (getpagesize() / 1024);
+        }
+    }
+    dl_iterate_phdr([](dl_phdr_info *, size_t, void *libs) -> int {
+        ++*static_cast<int *>(libs);
+        return 0;
+    }, &probe.libs);
+    return probe;
+}
+
+static void add_cost(ZygiskCostRecord::Module &cost, uint32_t &time_us, const CostProbe &start) {
+    auto end = CostProbe::now();
+    time_us += end.time_us - start.time_us;
+    cost.rss_delta_kb += static_cast<int32_t>(end.rss_kb - start.rss_kb);
+    cost.lib_delta += end.libs - start.libs;
+}
+
 ZygiskModule::ZygiskModule(int id, void *handle, void *entry)
-    : id(id), handle(handle), entry{entry}, api{}, mod{nullptr} {
+    : cost{ .id = id }, id(id), handle(handle), entry{entry}, api{}, mod{nullptr} {
     // Make sure all pointers are null
     memset(&api, 0, sizeof(api));
     api.base.impl = this;
@@ -161,38 +205,121 @@ void ZygiskModule::postServerSpecialize(const ServerSpecializeArgs_v1 *args) con
 
 // -----------------------------------------------------------------
 
+ZygiskContext::PltPattern::PltPattern(const char *pattern) : kind(REGEX) {
+    // Patterns are POSIX basic regular expressions. Only accept the ones that are
+    // a plain path with optional anchors, everything else goes through regcomp.
+    string_view p = pattern;
+    bool head = false;
+    bool tail = false;
+    if (p.starts_with('^')) {
+        head = true;
+        p.remove_prefix(1);
+    }
+    if (p.starts_with(".*")) {
+        head = false;
+        p.remove_prefix(2);
+    }
+    if (p.ends_with('$') && !p.ends_with("\\$")) {
+        tail = true;
+        p.remove_suffix(1);
+    } else if (p.ends_with(".*") && !p.ends_with("\\.*")) {
+        p.remove_suffix(2);
+    }
+
+    bool plain = true;
+    for (size_t i = 0; i < p.size(); ++i) {
+        char c = p[i];
+        if (c == '\\') {
+            // Escaped characters other than these have special meanings
+            if (++i == p.size() || strchr(".[]*^$\\/", p[i]) == nullptr) {
+                plain = false;
+                break;
+            }
+            c = p[i];
+        } else if (strchr(".[*^$", c) != nullptr) {
+            plain = false;
+            break;
+        }
+        literal += c;
+    }
+
+    if (plain) {
+        kind = head ? (tail ? EXACT : PREFIX) : (tail ? SUFFIX : CONTAINS);
+    } else {
+        literal.clear();
+        compiled = regcomp(&regex, pattern, REG_NOSUB) == 0;
+    }
+}
+
+ZygiskContext::PltPattern::PltPattern(PltPattern &&o) noexcept :
+    kind(o.kind), compiled(o.compiled), literal(std::move(o.literal)), regex(o.regex) {
+    o.compiled = false;
+}
+
+ZygiskContext::PltPattern::~PltPattern() {
+    if (compiled)
+        regfree(&regex);
+}
+
+bool ZygiskContext::PltPattern::match(string_view path) const {
+    switch (kind) {
+    case EXACT:
+        return path == literal;
+    case PREFIX:
+        return path.starts_with(literal);
+    case SUFFIX:
+        return path.ends_with(literal);
+    case CONTAINS:
+        return path.find(literal) != string_view::npos;
+    case REGEX:
+        // Paths from MapInfo are always null terminated
+        return compiled && regexec(&regex, path.data(), 0, nullptr, 0) == 0;
+    }
+    return false;
+}
+
 void ZygiskContext::plt_hook_register(const char *regex, const char *symbol, void *fn, void **backup) {
     if (regex == nullptr || symbol == nullptr || fn == nullptr)
         return;
-    regex_t re;
-    if (regcomp(&re, regex, REG_NOSUB) != 0)
+    PltPattern pattern(regex);
+    if (!pattern.valid())
         return;
     mutex_guard lock(hook_info_lock);
-    register_info.emplace_back(RegisterInfo{re, symbol, fn, backup});
+    register_info.emplace_back(RegisterInfo{std::move(pattern), symbol, fn, backup});
 }
 
 void ZygiskContext::plt_hook_exclude(const char *regex, const char *symbol) {
     if (!regex) return;
-    regex_t re;
-    if (regcomp(&re, regex, REG_NOSUB) != 0)
+    PltPattern pattern(regex);
+    if (!pattern.valid())
         return;
     mutex_guard lock(hook_info_lock);
-    ignore_info.emplace_back(IgnoreInfo{re, symbol ?: ""});
+    ignore_info.emplace_back(IgnoreInfo{std::move(pattern), symbol ?: ""});
 }
 
 void ZygiskContext::plt_hook_process_regex() {
     if (register_info.empty())
         return;
-    for (auto &map : lsplt::MapInfo::Scan()) {
+    auto maps = lsplt::MapInfo::Scan();
+    // A library is usually mapped multiple times, only match each of them once
+    set<tuple<dev_t, ino_t, string_view>> seen;
+    // Match results of ignore_info for the current map: -1 unknown, 0 no, 1 yes
+    vector<int8_t> ignore_match(ignore_info.size());
+    for (auto &map : maps) {
         if (map.offset != 0 || !map.is_private || !(map.perms & PROT_READ)) continue;
+        if (!seen.emplace(map.dev, map.inode, map.path).second) continue;
+        std::fill(ignore_match.begin(), ignore_match.end(), -1);
         for (auto &reg: register_info) {
-            if (regexec(&reg.regex, map.path.data(), 0, nullptr, 0) != 0)
+            if (!reg.pattern.match(map.path))
                 continue;
             bool ignored = false;
-            for (auto &ign: ignore_info) {
-                if (regexec(&ign.regex, map.path.data(), 0, nullptr, 0) != 0)
+            for (size_t i = 0; i < ignore_info.size(); ++i) {
+                auto &ign = ignore_info[i];
+                if (!ign.symbol.empty() && ign.symbol != reg.symbol)
                     continue;
-                if (ign.symbol.empty() || ign.symbol == reg.symbol) {
+                if (ignore_match[i] < 0)
+                    ignore_match[i] = ign.pattern.match(map.path);
+                if (ignore_match[i]) {
                     ignored = true;
                     break;
                 }
@@ -205,23 +332,95 @@ void ZygiskContext::plt_hook_process_regex() {
 }
 
 bool ZygiskContext::plt_hook_commit() {
+    int64_t start = now_us();
     {
         mutex_guard lock(hook_info_lock);
         plt_hook_process_regex();
-        for (auto& reg: register_info) {
-            regfree(&reg.regex);
-        }
-        for (auto& ign: ignore_info) {
-            regfree(&ign.regex);
-        }
         register_info.clear();
         ignore_info.clear();
     }
-    return lsplt::CommitHook();
+    bool result = lsplt::CommitHook();
+    cost.plt_commit_us += now_us() - start;
+    ++cost.plt_commit_count;
+    return result;
 }
 
 // -----------------------------------------------------------------
 
+// Mapped in zygote before forking so every child shares the same view
+static const ZygiskFlagsMap *flags_map = nullptr;
+
+static void map_flags_table() {
+    static bool attempted = false;
+    if (attempted)
+        return;
+    attempted = true;
+
+    owned_fd fd = zygisk_request(+ZygiskRequest::GetFlagsMap);
+    if (fd < 0)
+        return;
+    owned_fd map_fd = recv_fd(fd);
+    report_cost = read_int(fd) > 0;
+    struct stat st{};
+    if (map_fd < 0 || fstat(map_fd, &st) != 0 || st.st_size < sizeof(ZygiskFlagsMap))
+        return;
+    void *addr = mmap(nullptr, sizeof(ZygiskFlagsMap), PROT_READ, MAP_SHARED, map_fd, 0);
+    if (addr == MAP_FAILED)
+        return;
+    auto map = static_cast<const ZygiskFlagsMap *>(addr);
+    if (map->magic != ZygiskFlagsMap::MAGIC || map->capacity != ZygiskFlagsMap::CAPACITY) {
+        munmap(addr, sizeof(ZygiskFlagsMap));
+        return;
+    }
+    flags_map = map;
+}
+
+// FNV-1a over the uid followed by the process name
+static uint32_t flags_map_hash(int uid, string_view process) {
+    uint32_t h = 0x811c9dc5;
+    auto mix = [&](uint8_t b) {
+        h ^= b;
+        h *= 0x01000193;
+    };
+    for (size_t i = 0; i < sizeof(uid); ++i)
+        mix(static_cast<uint32_t>(uid) >> (i * 8));
+    for (char c : process)
+        mix(c);
+    return h;
+}
+
+static bool get_cached_info(int uid, const char *process, uint32_t &flags) {
+    if (flags_map == nullptr)
+        return false;
+    string_view name(process);
+    if (name.empty() || name.size() >= ZygiskFlagsMap::PROCESS_NAME_MAX)
+        return false;
+
+    uint32_t seq = __atomic_load_n(&flags_map->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return false;
+    bool found = false;
+    uint32_t result = 0;
+    uint32_t idx = flags_map_hash(uid, name) % ZygiskFlagsMap::CAPACITY;
+    for (uint32_t i = 0; i < ZygiskFlagsMap::CAPACITY; ++i) {
+        const auto &entry = flags_map->entries[idx];
+        if (entry.process[0] == '\0')
+            break;
+        if (entry.uid == uid && memcmp(entry.process, name.data(), name.size() + 1) == 0) {
+            result = entry.flags;
+            found = true;
+            break;
+        }
+        idx = (idx + 1) % ZygiskFlagsMap::CAPACITY;
+    }
+    // Discard the result if magiskd modified the table while we were reading
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&flags_map->seq, __ATOMIC_RELAXED) != seq || !found)
+        return false;
+    flags = result;
+    return true;
+}
+
 int ZygiskContext::get_module_info(int uid, rust::Vec<int> &fds) {
     if (int fd = zygisk_request(+ZygiskRequest::GetInfo); fd >= 0) {
         write_int(fd, uid);
@@ -240,12 +439,27 @@ int ZygiskContext::get_module_info(int uid, rust::Vec<int> &fds) {
     return -1;
 }
 
+// Close every fd not in the sorted list with one close_range call per gap.
+// Returns false if close_range is not supported (Linux < 5.9).
+static bool close_fds_except(const vector<int> &fds) {
+    unsigned first = 0;
+    for (int fd : fds) {
+        if (fd < 0)
+            continue;
+        if (static_cast<unsigned>(fd) > first && syscall(__NR_close_range, first, fd - 1, 0) != 0)
+            return false;
+        first = fd + 1;
+    }
+    return syscall(__NR_close_range, first, ~0U, 0) == 0;
+}
+
 void ZygiskContext::sanitize_fds() {
     zygisk_close_logd();
 
     if (!is_child()) {
         return;
     }
+    int64_t sanitize_start = now_us();
 
     if (can_exempt_fd() && !exempted_fds.empty()) {
         auto update_fd_array = [&](int old_len) -> jintArray {
@@ -255,11 +469,7 @@ void ZygiskContext::sanitize_fds() {
 
             env->SetIntArrayRegion(
                     array, old_len, static_cast<int>(exempted_fds.size()), exempted_fds.data());
-            for (int fd : exempted_fds) {
-                if (fd >= 0 && fd < allowed_fds.size()) {
-                    allowed_fds[fd] = true;
-                }
-            }
+            allowed_fds.insert(allowed_fds.end(), exempted_fds.begin(), exempted_fds.end());
             *args.app->fds_to_ignore = array;
             return array;
         };
@@ -267,12 +477,7 @@ void ZygiskContext::sanitize_fds() {
         if (jintArray fdsToIgnore = *args.app->fds_to_ignore) {
             int *arr = env->GetIntArrayElements(fdsToIgnore, nullptr);
             int len = env->GetArrayLength(fdsToIgnore);
-            for (int i = 0; i < len; ++i) {
-                int fd = arr[i];
-                if (fd >= 0 && fd < allowed_fds.size()) {
-                    allowed_fds[fd] = true;
-                }
-            }
+            allowed_fds.insert(allowed_fds.end(), arr, arr + len);
             if (jintArray newFdList = update_fd_array(len)) {
                 env->SetIntArrayRegion(newFdList, 0, len, arr);
             }
@@ -283,14 +488,24 @@ void ZygiskContext::sanitize_fds() {
     }
 
     // Close all forbidden fds to prevent crashing
-    auto dir = xopen_dir("/proc/self/fd");
-    int dfd = dirfd(dir.get());
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        int fd = parse_int(entry->d_name);
-        if ((fd < 0 || fd >= allowed_fds.size() || !allowed_fds[fd]) && fd != dfd) {
-            close(fd);
+    int64_t start = now_us();
+    ranges::sort(allowed_fds);
+    allowed_fds.erase(ranges::unique(allowed_fds).begin(), allowed_fds.end());
+    bool fast = close_fds_except(allowed_fds);
+    if (!fast) {
+        auto dir = xopen_dir("/proc/self/fd");
+        int dfd = dirfd(dir.get());
+        for (dirent *entry; (entry = xreaddir(dir.get()));) {
+            int fd = parse_int(entry->d_name);
+            if (fd != dfd && !ranges::binary_search(allowed_fds, fd)) {
+                close(fd);
+            }
         }
     }
+    ZLOGD("fds: scan %lldus, close %lldus (%s) [%s]\n",
+          static_cast<long long>(fd_scan_us), static_cast<long long>(now_us() - start),
+          fast ? "close_range" : "procfs", process);
+    cost.sanitize_fds_us = now_us() - sanitize_start;
 }
 
 bool ZygiskContext::exempt_fd(int fd) {
@@ -314,6 +529,9 @@ static int sigmask(int how, int signum) {
 }
 
 void ZygiskContext::fork_pre() {
+    map_flags_table();
+    prepare_unmount_plan();
+
     // Do our own fork before loading any 3rd party code
     // First block SIGCHLD, unblock after original fork is done
     sigmask(SIG_BLOCK, SIGCHLD);
@@ -322,22 +540,18 @@ void ZygiskContext::fork_pre() {
     if (!is_child())
         return;
 
-    // Record all open fds
+    // Record all open fds, procfs lists them in ascending order
+    int64_t start = now_us();
     auto dir = xopen_dir("/proc/self/fd");
+    // The dirfd will be closed once out of scope, and logd_fd should be handled separately
+    int dfd = dirfd(dir.get());
+    int logd_fd = zygisk_get_logd();
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
         int fd = parse_int(entry->d_name);
-        if (fd < 0 || fd >= allowed_fds.size()) {
-            close(fd);
-            continue;
-        }
-        allowed_fds[fd] = true;
-    }
-    // The dirfd will be closed once out of scope
-    allowed_fds[dirfd(dir.get())] = false;
-    // logd_fd should be handled separately
-    if (int fd = zygisk_get_logd(); fd >= 0) {
-        allowed_fds[fd] = false;
+        if (fd >= 0 && fd != dfd && fd != logd_fd)
+            allowed_fds.push_back(fd);
     }
+    fd_scan_us = now_us() - start;
 }
 
 void ZygiskContext::fork_post() {
@@ -377,31 +591,57 @@ void ZygiskContext::run_modules_pre(rust::Vec<int> &fds) {
     }
 
     for (auto &m : modules) {
+        auto probe = CostProbe::now();
         if (flags & APP_SPECIALIZE) {
             m.preAppSpecialize(args.app);
         } else if (flags & SERVER_FORK_AND_SPECIALIZE) {
             m.preServerSpecialize(args.server);
         }
+        add_cost(m.cost, m.cost.pre_us, probe);
     }
 }
 
 void ZygiskContext::run_modules_post() {
     flags |= POST_SPECIALIZE;
-    for (const auto &m : modules) {
+    for (auto &m : modules) {
+        auto probe = CostProbe::now();
         if (flags & APP_SPECIALIZE) {
             m.postAppSpecialize(args.app);
         } else if (flags & SERVER_FORK_AND_SPECIALIZE) {
             m.postServerSpecialize(args.server);
         }
+        add_cost(m.cost, m.cost.post_us, probe);
         m.tryUnload();
     }
 }
 
+void ZygiskContext::send_cost_record() {
+    // Sent through the log pipe that was reopened right before the secontext transition
+    if (!report_cost)
+        return;
+    auto probe = CostProbe::now();
+    cost.is_server = (flags & SERVER_FORK_AND_SPECIALIZE) ? 1 : 0;
+    cost.rss_delta_kb = static_cast<int32_t>(probe.rss_kb - cost_start.rss_kb);
+    cost.lib_delta = probe.libs - cost_start.libs;
+    cost.module_count = 0;
+    for (const auto &m : modules) {
+        if (cost.module_count == ZygiskCostRecord::MAX_MODULES)
+            break;
+        cost.modules[cost.module_count++] = m.cost;
+    }
+    size_t len = offsetof(ZygiskCostRecord, modules) +
+            cost.module_count * sizeof(ZygiskCostRecord::Module);
+    zygisk_send_cost_record(rust::Slice<const uint8_t>(reinterpret_cast<const uint8_t *>(&cost), len));
+}
+
 void ZygiskContext::app_specialize_pre() {
     flags |= APP_SPECIALIZE;
+    cost_start = CostProbe::now();
 
     rust::Vec<int> module_fds;
-    owned_fd fd = get_module_info(args.app->uid, module_fds);
+    // magiskd only publishes flags of processes that will not load any modules
+    bool cached = get_cached_info(args.app->uid, process, info_flags);
+    owned_fd fd = cached ? -1 : get_module_info(args.app->uid, module_fds);
     if ((info_flags & UNMOUNT_MASK) == UNMOUNT_MASK) {
         ZLOGI("[%s] is on the denylist\n", process);
         flags |= DO_REVERT_UNMOUNT;
@@ -415,12 +655,14 @@ void ZygiskContext::app_specialize_post() {
     if (info_flags & +ZygiskStateFlags::ProcessIsMagiskApp) {
         setenv("ZYGISK_ENABLED", "1", 1);
     }
+    send_cost_record();
 
     // Cleanups
     env->ReleaseStringUTFChars(args.app->nice_name, process);
 }
 
 void ZygiskContext::server_specialize_pre() {
+    cost_start = CostProbe::now();
     rust::Vec<int> module_fds;
     if (owned_fd fd = get_module_info(1000, module_fds); fd >= 0) {
         if (module_fds.empty()) {
@@ -442,6 +684,7 @@ void ZygiskContext::server_specialize_pre() {
 
 void ZygiskContext::server_specialize_post() {
     run_modules_post();
+    send_cost_record();
 }
 
 // -----------------------------------------------------------------
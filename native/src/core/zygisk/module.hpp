@@ -130,6 +130,68 @@ enum : uint32_t {
     PRIVATE_MASK = (+ZygiskStateFlags::DenyListEnforced | +ZygiskStateFlags::ProcessIsMagiskApp)
 };
 
+// Read-only table of (uid, process) -> ZygiskStateFlags published by magiskd.
+// The layout has to match zygisk/flags_map.rs
+struct ZygiskFlagsMap {
+    static constexpr uint32_t MAGIC = 0x5a464d31;
+    static constexpr uint32_t CAPACITY = 2048;
+    static constexpr size_t PROCESS_NAME_MAX = 120;
+
+    struct Entry {
+        int32_t uid;
+        uint32_t flags;
+        char process[PROCESS_NAME_MAX];
+    };
+
+    uint32_t magic;
+    // Odd while magiskd is modifying the table
+    uint32_t seq;
+    uint32_t capacity;
+    uint32_t reserved;
+    Entry entries[CAPACITY];
+};
+
+// Cost of a specialization reported to magiskd through the log pipe.
+// The layout has to match zygisk/cost.rs, only used module entries are sent.
+struct ZygiskCostRecord {
+    static constexpr size_t MAX_MODULES = 64;
+
+    struct Module {
+        int32_t id;
+        uint32_t pre_us;
+        uint32_t post_us;
+        int32_t rss_delta_kb;
+        int32_t lib_delta;
+    };
+
+    uint32_t is_server;
+    uint32_t module_count;
+    uint32_t plt_commit_us;
+    uint32_t plt_commit_count;
+    uint32_t sanitize_fds_us;
+    int32_t rss_delta_kb;
+    int32_t lib_delta;
+    uint32_t reserved;
+    Module modules[MAX_MODULES];
+};
+
+// Mirrored by the layout test in zygisk/cost.rs
+static_assert(sizeof(ZygiskCostRecord::Module) == 20);
+static_assert(offsetof(ZygiskCostRecord::Module, post_us) == 8);
+static_assert(offsetof(ZygiskCostRecord::Module, lib_delta) == 16);
+static_assert(offsetof(ZygiskCostRecord, sanitize_fds_us) == 16);
+static_assert(offsetof(ZygiskCostRecord, lib_delta) == 24);
+static_assert(offsetof(ZygiskCostRecord, modules) == 32);
+
+// Snapshot of the process to measure zygisk and module callbacks against
+struct CostProbe {
+    int64_t time_us;
+    int64_t rss_kb;
+    int libs;
+
+    static CostProbe now();
+};
+
 struct api_abi_base {
     ZygiskModule *impl;
     bool (*registerModule)(ApiTable *, long *);
@@ -190,6 +252,9 @@ struct ZygiskModule {
 
     static bool RegisterModuleImpl(ApiTable *api, long *module);
 
+    // Filled in by ZygiskContext when running the callbacks
+    ZygiskCostRecord::Module cost;
+
 private:
     const int id;
     bool unload = false;
@@ -238,18 +303,44 @@ struct ZygiskContext {
     int pid;
     uint32_t flags;
     uint32_t info_flags;
-    std::vector<bool> allowed_fds;
+    // Sorted fds that were open at fork, only these survive sanitize_fds
+    std::vector<int> allowed_fds;
     std::vector<int> exempted_fds;
+    int64_t fd_scan_us;
 
-    struct RegisterInfo {
+    CostProbe cost_start;
+    ZygiskCostRecord cost;
+
+    // A path pattern registered by modules. Most patterns are plain paths, optionally
+    // anchored, which are matched with string operations instead of regexec.
+    class PltPattern {
+    public:
+        enum Kind { EXACT, PREFIX, SUFFIX, CONTAINS, REGEX };
+
+        explicit PltPattern(const char *pattern);
+        PltPattern(PltPattern &&o) noexcept;
+        PltPattern(const PltPattern &) = delete;
+        ~PltPattern();
+
+        bool valid() const { return kind != REGEX || compiled; }
+        bool match(std::string_view path) const;
+
+    private:
+        Kind kind;
+        bool compiled = false;
+        std::string literal;
         regex_t regex;
+    };
+
+    struct RegisterInfo {
+        PltPattern pattern;
         std::string symbol;
         void *callback;
         void **backup;
     };
 
     struct IgnoreInfo {
-        regex_t regex;
+        PltPattern pattern;
         std::string symbol;
     };
 
@@ -281,6 +372,8 @@ struct ZygiskContext {
     void plt_hook_process_regex();
 
     bool plt_hook_commit();
+
+    void send_cost_record();
 };
 
 #undef DCL_PRE_POST
@@ -0,0 +1,150 @@
+use crate::daemon::{AID_ROOT, AID_SHELL, MagiskD, to_app_id, to_user_id};
+use crate::db::DbArg::Integer;
+use crate::db::{MultiuserMode, RootAccess, SqlTable, SqliteReturn};
+use crate::ffi::{
+    DbValues, SuPolicy, ZygiskStateFlags, is_deny_target, is_denylist_enforced, load_deny_index,
+};
+use base::{LoggedResult, log_err};
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::sync::atomic::Ordering;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+// Everything required to compute the flags of a new app process. It is rebuilt
+// whenever the denylist, su policies, or settings change, so GetInfo can be
+// answered without touching SQLite or the denylist lock. Denylist targets are
+// matched against the lock-free DenyIndex, which is swapped as a whole and
+// invalidates this table on every change.
+#[derive(Default)]
+pub struct DecisionTable {
+    loaded: bool,
+    generation: u32,
+    deny_enforced: bool,
+    root_access: RootAccess,
+    multiuser_mode: MultiuserMode,
+    // uid -> expiration time of the allow policy, 0 means forever
+    root_grants: HashMap<i32, i64>,
+}
+
+struct RootGrants(HashMap<i32, i64>);
+
+impl SqlTable for RootGrants {
+    fn on_row(&mut self, _: &[String], values: &DbValues) {
+        self.0.insert(values.get_int(0), values.get_int(1) as i64);
+    }
+}
+
+impl DecisionTable {
+    pub fn generation(&self) -> u32 {
+        self.generation
+    }
+
+    // A table that failed to load must never be cached anywhere
+    pub fn is_loaded(&self) -> bool {
+        self.loaded
+    }
+
+    pub fn deny_flags(&self, uid: i32, process: &str) -> u32 {
+        let mut flags = 0;
+        if is_deny_target(uid, process) {
+            flags |= ZygiskStateFlags::ProcessOnDenyList.repr;
+        }
+        if self.deny_enforced {
+            flags |= ZygiskStateFlags::DenyListEnforced.repr;
+        }
+        flags
+    }
+
+    pub fn uid_granted_root(&self, mut uid: i32) -> bool {
+        if uid == AID_ROOT {
+            return true;
+        }
+
+        // Check user root access settings
+        match self.root_access {
+            RootAccess::Disabled => return false,
+            RootAccess::AppsOnly if uid == AID_SHELL => return false,
+            RootAccess::AdbOnly if uid != AID_SHELL => return false,
+            _ => {}
+        }
+
+        // Check multiuser settings
+        match self.multiuser_mode {
+            MultiuserMode::OwnerOnly if to_user_id(uid) != 0 => return false,
+            MultiuserMode::OwnerManaged => uid = to_app_id(uid),
+            _ => {}
+        }
+
+        match self.root_grants.get(&uid) {
+            None => false,
+            Some(0) => true,
+            Some(until) => SystemTime::now()
+                .duration_since(UNIX_EPOCH)
+                .is_ok_and(|now| *until > now.as_secs() as i64),
+        }
+    }
+}
+
+impl MagiskD {
+    fn build_decision_table(&self, generation: u32) -> LoggedResult<DecisionTable> {
+        // Never publish a table that would treat every process as not denied
+        if !load_deny_index() {
+            return log_err!("denylist: failed to load targets");
+        }
+
+        let cfg = self.get_db_settings()?;
+
+        let mut grants = RootGrants(HashMap::new());
+        self.db_query_with_rows(
+            "SELECT uid, until FROM policies WHERE policy=?",
+            &[Integer(SuPolicy::Allow.repr as i64)],
+            &mut grants,
+        )
+        .sql_result()?;
+
+        Ok(DecisionTable {
+            loaded: true,
+            generation,
+            deny_enforced: is_denylist_enforced(),
+            root_access: cfg.root_access,
+            multiuser_mode: cfg.multiuser_mode,
+            root_grants: grants.0,
+        })
+    }
+
+    pub fn decision_table(&self) -> Arc<DecisionTable> {
+        let is_current = |table: &DecisionTable| {
+            table.loaded && table.generation == self.decision_generation.load(Ordering::Acquire)
+        };
+
+        let table = self.decision_table.load();
+        if is_current(&table) {
+            return table;
+        }
+
+        let _guard = self.decision_table_lock.lock();
+        // Another thread could have rebuilt the table while we were waiting
+        let table = self.decision_table.load();
+        if is_current(&table) {
+            return table;
+        }
+        // Record the generation before reading any data, so changes that
+        // happen during the rebuild invalidate the new table right away.
+        let generation = self.decision_generation.load(Ordering::Acquire);
+        match self.build_decision_table(generation) {
+            Ok(table) => {
+                let table = Arc::new(table);
+                self.decision_table.store(table.clone());
+                table
+            }
+            // Nothing is denied or granted if the data is unavailable. The table is
+            // not stored, so the next request retries loading it.
+            Err(_) => Arc::new(DecisionTable::default()),
+        }
+    }
+
+    pub fn invalidate_decision_table(&self) {
+        let generation = self.decision_generation.fetch_add(1, Ordering::AcqRel) + 1;
+        self.flags_map.clear(generation);
+    }
+}
@@ -1,7 +1,7 @@
 use crate::ffi::MagiskInit;
 use base::{
-    Directory, FsPathBuilder, LibcReturn, LoggedResult, ResultExt, Utf8CStr, cstr, debug, libc,
-    nix, parse_mount_info, raw_cstr,
+    Directory, FsPathBuilder, LibcReturn, LoggedResult, MountInfoTable, ResultExt, Utf8CStr, cstr,
+    debug, libc, nix, raw_cstr,
 };
 use cxx::CxxString;
 use nix::mount::MsFlags;
@@ -19,21 +19,22 @@ unsafe extern "C" {
 pub(crate) fn switch_root(path: &Utf8CStr) {
     || -> LoggedResult<()> {
         debug!("Switch root to {}", path);
+        let mount_table = MountInfoTable::read("self");
         let mut mounts = BTreeSet::new();
         let rootfs = Directory::open(cstr!("/"))?;
-        for info in parse_mount_info("self") {
-            if info.target == "/" || info.target.as_str() == path.as_str() {
+        for info in mount_table.iter() {
+            if info.target == "/" || info.target == path.as_str() {
                 continue;
             }
             if let Some(last_mount) = mounts
-                .range::<String, _>((Unbounded, Excluded(&info.target)))
+                .range::<&str, _>((Unbounded, Excluded(info.target)))
                 .last()
                 && info.target.starts_with(&format!("{}/", *last_mount))
             {
                 continue;
             }
 
-            let mut target = info.target.clone();
+            let mut target = info.target.to_string();
             let target = Utf8CStr::from_string(&mut target);
             let new_path = cstr::buf::default()
                 .join_path(path)
@@ -54,7 +55,7 @@ pub(crate) fn switch_root(path: &Utf8CStr) {
 }
 
 pub(crate) fn is_device_mounted(dev: u64, target: Pin<&mut CxxString>) -> bool {
-    for mount in parse_mount_info("self") {
+    for mount in MountInfoTable::read("self").iter() {
         if mount.root == "/" && mount.device == dev {
             target.push_str(&mount.target);
             return true;